@@ -7,13 +7,23 @@ void cpptoolkit::AsyncConsumer::ConsumerLoop() {
   PostCoreLoop();
 }
 
-void cpptoolkit::AsyncConsumer::CoreLoop() { DefaultCoreLoop(); }
+void cpptoolkit::AsyncConsumer::CoreLoop() {
+  if (is_batch_mode()) {
+    DefaultBatchCoreLoop();
+  } else {
+    DefaultCoreLoop();
+  }
+}
 
 void cpptoolkit::AsyncConsumer::PostCoreLoop() { CleanUpBuffer(); }
 
 void cpptoolkit::AsyncConsumer::DefaultCoreLoop() {
   try {
+    std::int64_t lock_start = MetricsNow();
     SafeLockUp lock(lock_data_transfer_, 0);
+    if (lock_start) {
+      metrics_.RecordLockWait(ConsumerMetrics::Now() - lock_start);
+    }
     if (is_need_wait_for_data()) {
       lock.wait();
     } else {
@@ -22,12 +32,75 @@ void cpptoolkit::AsyncConsumer::DefaultCoreLoop() {
     if (!flag_run_) {
       return;
     }
+    bool flag_loaded = false;
     if (!is_data_buffer_empty()) {
       LoadDataForProcess();
+      flag_loaded = is_data_loaded();
+      NotifyBufferSpace();
+    }
+    if (metrics_.enabled()) {
+      metrics_.RecordQueueDepth(data_buffer_size());
     }
     lock.unlock();
-    if (flag_run_) {
+    // Never process stale data after a wake-up without a new item.
+    if (flag_run_ && flag_loaded) {
+      std::int64_t process_start = MetricsNow();
       ProcessData();
+      if (process_start) {
+        metrics_.RecordProcessTime(ConsumerMetrics::Now() - process_start, 1);
+      }
+    }
+  } catch (...) {
+    HandleException(boost::current_exception());
+  }
+}
+
+void cpptoolkit::AsyncConsumer::DefaultBatchCoreLoop() {
+  try {
+    std::int64_t lock_start = MetricsNow();
+    SafeLockUp lock(lock_data_transfer_, 0);
+    if (lock_start) {
+      metrics_.RecordLockWait(ConsumerMetrics::Now() - lock_start);
+    }
+    if (is_need_wait_for_data()) {
+      lock.wait();
+    } else {
+      lock.signal_off();  // reset signal flag.
+    }
+    if (!flag_run_) {
+      return;
+    }
+    if (batch_max_latency_.count() > 0) {
+      // Wait for a full batch, but never longer than the latency budget.
+      auto deadline = std::chrono::steady_clock::now() + batch_max_latency_;
+      while (flag_run_ && data_buffer_size() < batch_max_size_) {
+        if (!lock.wait_until(deadline)) {
+          break;
+        }
+      }
+    }
+    bool flag_loaded = false;
+    std::size_t number_of_items = 0;
+    if (!is_data_buffer_empty()) {
+      std::size_t size_before = data_buffer_size();
+      LoadBatchForProcess(batch_max_size_);
+      flag_loaded = true;
+      NotifyBufferSpace();
+      std::size_t size_after = data_buffer_size();
+      number_of_items = size_before > size_after ? size_before - size_after : 1;
+      if (metrics_.enabled()) {
+        metrics_.RecordQueueDepth(size_after);
+      }
+    }
+    lock.unlock();
+    // A loaded batch is always processed, so stopping never loses it.
+    if (flag_loaded) {
+      std::int64_t process_start = MetricsNow();
+      ProcessBatch();
+      if (process_start) {
+        metrics_.RecordProcessTime(ConsumerMetrics::Now() - process_start,
+                                   number_of_items);
+      }
     }
   } catch (...) {
     HandleException(boost::current_exception());
@@ -37,8 +110,19 @@ void cpptoolkit::AsyncConsumer::DefaultCoreLoop() {
 void cpptoolkit::AsyncConsumer::CleanUpBuffer() {
   while (!is_data_buffer_empty()) {
     try {
-      LoadDataForProcess();
-      ProcessData();
+      // Drain through the same hook as the loop, ProcessBatch() may be the
+      // only one a batch mode subclass implements.
+      if (is_batch_mode()) {
+        LoadBatchForProcess(batch_max_size_);
+        NotifyBufferSpace();
+        ProcessBatch();
+      } else {
+        LoadDataForProcess();
+        NotifyBufferSpace();
+        if (is_data_loaded()) {
+          ProcessData();
+        }
+      }
     } catch (...) {
       auto level = HandleException(boost::current_exception());
       if (level != ErrorLevel::E_WARNING) {
@@ -48,6 +132,43 @@ void cpptoolkit::AsyncConsumer::CleanUpBuffer() {
   }
 }
 
+bool cpptoolkit::AsyncConsumer::AdmitData(SafeLockUp& lock) {
+  if (buffer_capacity_ == 0 || data_buffer_size() < buffer_capacity_) {
+    return true;
+  }
+  switch (overflow_policy_) {
+    case OverflowPolicy::kBlock: {
+      ++blocked_count_;
+      auto deadline = std::chrono::steady_clock::now() + block_timeout_;
+      // Never block on a stopped consumer, nobody would make room.
+      if (lock.wait_until(1, deadline, [this] {
+            return !flag_run_ || data_buffer_size() < buffer_capacity_;
+          })) {
+        return true;
+      }
+      ++dropped_count_;
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::runtime_error(
+              "Data buffer stayed full for " +
+              std::to_string(block_timeout_.count()) + " ms, data dropped."),
+          ErrorLevel::E_WARNING);
+    }
+    case OverflowPolicy::kDropOldest:
+      ++dropped_count_;
+      return DropOldestData();
+    case OverflowPolicy::kDropNewest:
+      ++dropped_count_;
+      return false;
+    case OverflowPolicy::kWarn:
+    default:
+      ++dropped_count_;
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::runtime_error("Data buffer is full, data dropped."),
+          ErrorLevel::E_WARNING);
+  }
+  return false;
+}
+
 void cpptoolkit::AsyncConsumer::PreGetData() {
   //Check Critical Exception
   // First check existed critical exceptions
@@ -135,8 +256,14 @@ void cpptoolkit::AsyncConsumerTest::ProcessDataAsync(
   PreGetData();
   try {
     if (!flag_handling_error_) {
+      std::int64_t lock_start = MetricsNow();
       SafeLockUp lock(lock_data_transfer_, 0);
-      GetData(std::move(data_ptr));
+      if (lock_start) {
+        metrics_.RecordLockWait(ConsumerMetrics::Now() - lock_start);
+      }
+      if (AdmitData(lock)) {
+        GetData(std::move(data_ptr));
+      }
       lock.notify_and_unlock();
     }
   } catch (...) {
@@ -151,17 +278,44 @@ void cpptoolkit::AsyncConsumerTest::ProcessDataAsync(
 void cpptoolkit::AsyncConsumerTest::LoadDataForProcess() { 
   loaded_data_ = std::move(queue_data_buffer_.front());
   queue_data_buffer_.pop();
+  PopEnqueueTime();
 }
 
 void cpptoolkit::AsyncConsumerTest::ProcessData() {
   LOG_INFO("[Consumer Process]First elem: {}", loaded_data_[0]);
 }
 
+void cpptoolkit::AsyncConsumerTest::LoadBatchForProcess(
+    std::size_t max_batch_size) {
+  loaded_batch_.clear();
+  while (!queue_data_buffer_.empty() && loaded_batch_.size() < max_batch_size) {
+    loaded_batch_.push_back(std::move(queue_data_buffer_.front()));
+    queue_data_buffer_.pop();
+    PopEnqueueTime();
+  }
+}
+
+void cpptoolkit::AsyncConsumerTest::ProcessBatch() {
+  LOG_INFO("[Consumer Process]Batch size: {}, first elem: {}",
+           loaded_batch_.size(), loaded_batch_.front()[0]);
+}
+
+bool cpptoolkit::AsyncConsumerTest::DropOldestData() {
+  if (queue_data_buffer_.empty()) {
+    return false;
+  }
+  queue_data_buffer_.pop();
+  queue_enqueue_time_.pop();
+  return true;
+}
+
 void cpptoolkit::AsyncConsumerTest::ClearDataBuffer() {
   queue_data_buffer_ = std::queue<std::unique_ptr<int[]>>();
+  queue_enqueue_time_ = std::queue<std::int64_t>();
 }
 
 void cpptoolkit::AsyncConsumerTest::GetData(std::unique_ptr<int[]> data_ptr) {
   queue_data_buffer_.push(std::move(data_ptr));
+  queue_enqueue_time_.push(MetricsNow());
   LOG_DEBUG("GetData Succeed! Queue size:{}", queue_data_buffer_.size());
 }
@@ -11,15 +11,32 @@
 #ifndef CPPTOOLKIT_ASYNC_CONSUMER_H_
 #define CPPTOOLKIT_ASYNC_CONSUMER_H_
 
-#include <boost\exception\all.hpp>
-#include <boost\lockfree\queue.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
 #include <memory>
 #include "handle_exception.h"
 #include <queue>
+#include <thread>
+#include <vector>
+#include "consumer_metrics.h"
 #include "log.h"
 #include "locks.h"
 
 namespace cpptoolkit {
+
+// What a producer does when the consumer's buffer has reached its capacity.
+enum class OverflowPolicy {
+  kBlock,       // Wait for free space, drop with E_WARNING on timeout.
+  kDropOldest,  // Discard the oldest buffered item to make room.
+  kDropNewest,  // Discard the item being pushed.
+  kWarn         // Discard the item being pushed and raise an E_WARNING.
+};
+
 class AsyncConsumer {
  public:
   AsyncConsumer() = default;
@@ -28,15 +45,53 @@ class AsyncConsumer {
   AsyncConsumer& operator=(const AsyncConsumer&) = delete;
   virtual void Init() { flag_init_ = true; }
 
+  // Pass as max_batch_size to drain everything queued in one batch.
+  static constexpr std::size_t kDrainAll =
+      std::numeric_limits<std::size_t>::max();
+
+  // Opt-in batch mode, call before the consumer is started.
+  // The consumer loads up to max_batch_size items in one critical section
+  // and hands them to ProcessBatch(). If max_latency is positive, it waits
+  // up to max_latency for a full batch before processing a partial one.
+  // max_batch_size == 0 turns batch mode off.
+  void set_batch_mode(
+      std::size_t max_batch_size,
+      std::chrono::microseconds max_latency = std::chrono::microseconds(0)) {
+    batch_max_size_ = max_batch_size;
+    batch_max_latency_ = max_latency;
+  }
+  bool is_batch_mode() const { return batch_max_size_ > 0; }
+
+  // Bound the data buffer, call before the consumer is started.
+  // capacity == 0 means unbounded. Subclasses must override
+  // data_buffer_size() for the capacity to take effect.
+  void set_buffer_capacity(
+      std::size_t capacity, OverflowPolicy policy = OverflowPolicy::kBlock,
+      std::chrono::milliseconds block_timeout = std::chrono::milliseconds(1000)) {
+    buffer_capacity_ = capacity;
+    overflow_policy_ = policy;
+    block_timeout_ = block_timeout;
+  }
+  std::uint64_t dropped_count() const { return dropped_count_.load(); }
+  std::uint64_t blocked_count() const { return blocked_count_.load(); }
+
+  // Latency and throughput, enabled by default. Safe to read from any thread.
+  ConsumerMetrics& metrics() { return metrics_; }
+  const ConsumerMetrics& metrics() const { return metrics_; }
+
  protected:
   bool flag_init_ = false;
   bool flag_run_ = false;
   std::unique_ptr<std::thread> th_loop_;
-  Locks lock_data_transfer_;
+  // Lock 0 guards the data buffer and signals data available.
+  // Condition 1 is used with lock 0 to signal free buffer space.
+  Locks lock_data_transfer_{2};
   
   virtual void Start() { start_loop(); }
   void start_loop() {
     if (flag_run_ == false) {
+      // A loop stopped from its own thread was not joined yet.
+      join_loop();
       // Clear queue_critical_exception_ptr_
       queue_critical_exception_ptr_ = std::queue<boost::exception_ptr>();
       flag_run_ = true;
@@ -48,14 +103,22 @@ class AsyncConsumer {
   virtual void CoreLoop();
   virtual void PostCoreLoop();
   void DefaultCoreLoop();
+  void DefaultBatchCoreLoop();
   void CleanUpBuffer();
   void stop_loop() {
     if (flag_run_ == true) {
       flag_run_ = false;
       lock_data_transfer_.NotifyAll();
-      if (th_loop_ && th_loop_->joinable()) {
-        th_loop_->join();
-      }
+    }
+    join_loop();
+  }
+  // The consumer thread cannot join itself, e.g. when handle_error() runs
+  // on it. It then only leaves the loop, and the next start_loop() or
+  // Close() from another thread joins it.
+  void join_loop() {
+    if (th_loop_ && th_loop_->joinable() &&
+        th_loop_->get_id() != std::this_thread::get_id()) {
+      th_loop_->join();
     }
   }
   virtual void Close() {
@@ -68,8 +131,49 @@ class AsyncConsumer {
   virtual void ClearDataBuffer() = 0;
   virtual bool is_need_wait_for_data() = 0;
   virtual bool is_data_buffer_empty() = 0;
+  // Whether the last LoadDataForProcess() loaded an item. Override if
+  // loading can fail although the buffer was not empty, e.g. because
+  // another thread took the item first.
+  virtual bool is_data_loaded() { return true; }
   bool never_wait_for_data() { return false; }
 
+  // Batch mode hooks. The defaults fall back to one item per batch, override
+  // all three to amortise per-item overhead.
+  std::size_t batch_max_size_ = 0;
+  std::chrono::microseconds batch_max_latency_{0};
+  virtual std::size_t data_buffer_size() {
+    return is_data_buffer_empty() ? 0 : 1;
+  }
+  virtual void LoadBatchForProcess(std::size_t /*max_batch_size*/) {
+    LoadDataForProcess();
+  }
+  virtual void ProcessBatch() { ProcessData(); }
+
+  // Backpressure, see set_buffer_capacity().
+  std::size_t buffer_capacity_ = 0;
+  OverflowPolicy overflow_policy_ = OverflowPolicy::kWarn;
+  std::chrono::milliseconds block_timeout_{1000};
+  std::atomic<std::uint64_t> dropped_count_{0};
+  std::atomic<std::uint64_t> blocked_count_{0};
+  // Call in GetData with lock 0 held. Applies overflow_policy_ and returns
+  // false if the new item should be dropped.
+  bool AdmitData(SafeLockUp& lock);
+  // Call on the consumer side after items are taken out of the buffer.
+  void NotifyBufferSpace() {
+    if (buffer_capacity_ > 0) {
+      lock_data_transfer_.notify_all(1);
+    }
+  }
+  ConsumerMetrics metrics_;
+  // Returns a timestamp for the metrics, or 0 if they are disabled.
+  std::int64_t MetricsNow() const {
+    return metrics_.enabled() ? ConsumerMetrics::Now() : 0;
+  }
+
+  // Remove the oldest buffered item for OverflowPolicy::kDropOldest.
+  // Returns false if not supported, the new item is dropped instead.
+  virtual bool DropOldestData() { return false; }
+
   void PreGetData();
   void PostGetData();
 
@@ -108,7 +212,10 @@ class AsyncConsumerTest : public AsyncConsumer {
 
  protected:
   std::queue<std::unique_ptr<int[]>> queue_data_buffer_;
+  // MetricsNow() of every buffered item, for the queue latency.
+  std::queue<std::int64_t> queue_enqueue_time_;
   std::unique_ptr<int[]> loaded_data_;
+  std::vector<std::unique_ptr<int[]>> loaded_batch_;
   int width_;
   int height_;
 
@@ -120,8 +227,19 @@ class AsyncConsumerTest : public AsyncConsumer {
   virtual bool is_need_wait_for_data() { return queue_data_buffer_.empty(); }
   virtual bool is_data_buffer_empty() { return queue_data_buffer_.empty(); }
 
+  virtual std::size_t data_buffer_size() { return queue_data_buffer_.size(); }
+  virtual void LoadBatchForProcess(std::size_t max_batch_size);
+  virtual void ProcessBatch();
+  virtual bool DropOldestData();
+
  private:
   void GetData(std::unique_ptr<int[]> data_ptr);
+  void PopEnqueueTime() {
+    if (queue_enqueue_time_.front() != 0) {
+      metrics_.RecordQueueLatency(queue_enqueue_time_.front());
+    }
+    queue_enqueue_time_.pop();
+  }
 
 };
 
@@ -0,0 +1,425 @@
+/*
+ * async_h5_writer.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * AsyncH5Writer writes HDF5 datasets on its own consumer thread.
+ *   It owns a SafeHighFiveFile. Producers move xarrays or raw buffers into
+ *   Write() (a whole dataset), Append() (one frame of a growing dataset,
+ *   see H5StreamWriter) or AppendFrames() (frames stacked along a new
+ *   first axis) and return right away. The consumer runs in batch
+ *   mode: it takes every queued request at once, merges consecutive frames
+ *   appended to the same dataset into one hyperslab write, and flushes the
+ *   file at most once per batch.
+ *   Pass an ItemCompletion to be told when a request is written, or call
+ *   Flush() to wait until everything submitted before it is written and
+ *   the file is flushed. A failed request completes its ItemCompletion with
+ *   the error and is handed to HandleException() with write_error_level(),
+ *   E_WARNING by default, so the writer goes on with the other requests.
+ *   The file stays open for the writer's lifetime but is only locked
+ *   while a batch is written (H5LockScope::kScoped), so in
+ *   H5LockMode::kGlobal, the default without a threadsafe HDF5, other
+ *   SafeHighFiveFiles only wait for the batch in progress.
+ *
+ * Usage example:
+ *
+ *     AsyncH5Writer writer("record.h5", HighFive::File::Overwrite);
+ *     writer.Init();
+ *     writer.Write("/meta/roi", std::move(roi));
+ *     writer.Append("/frames", std::move(frame));  // from the camera thread
+ *     writer.Flush();
+ */
+
+#ifndef CPPTOOLKIT_ASYNC_H5_WRITER_H_
+#define CPPTOOLKIT_ASYNC_H5_WRITER_H_
+
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <CppToolkit/h5_stream_writer.h>
+#include <CppToolkit/hdf5_toolkit_core.h>
+#include <CppToolkit/item_completion.h>
+#include <CppToolkit/ring_async_consumer.h>
+
+namespace cpptoolkit {
+
+class AsyncH5Writer;
+
+// A request queued in an AsyncH5Writer, run on its consumer thread.
+class H5WriteRequest {
+ public:
+  virtual ~H5WriteRequest() = default;
+  virtual void Run(AsyncH5Writer& writer) = 0;
+  // Take over next if both can be written in one go, e.g. frames appended
+  // to the same dataset.
+  virtual bool Merge(H5WriteRequest& next) { return false; }
+};
+
+class AsyncH5Writer
+    : public RingAsyncConsumer<std::unique_ptr<H5WriteRequest>> {
+ public:
+  explicit AsyncH5Writer(
+      const std::string& filename,
+      HighFive::File::AccessMode open_flags = HighFive::File::OpenOrCreate,
+      std::size_t capacity = 1024)
+      : RingAsyncConsumer<std::unique_ptr<H5WriteRequest>>(capacity),
+        file_(filename, open_flags, H5LockScope::kScoped) {
+    set_batch_mode(kDrainAll);
+  }
+  // Writes everything queued, then closes the streams and the file.
+  virtual ~AsyncH5Writer() {
+    Close();
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    CloseStreams();
+  }
+
+  // completion may be nullptr, otherwise it must stay alive until it is
+  // completed.
+  template <typename T>
+  void Write(std::string path, xt::xarray<T> data,
+             H5WriteOptions options = H5WriteOptions(),
+             ItemCompletion* completion = nullptr) {
+    Submit(std::make_unique<DumpRequest<T>>(std::move(path), std::move(data),
+                                            std::move(options)),
+           completion);
+  }
+  // Raw buffer of the given shape, e.g. a BufferPool<T>::PooledBuffer.
+  template <typename T, typename Deleter>
+  void Write(std::string path, std::unique_ptr<T[], Deleter> buffer,
+             const std::vector<size_t>& shape,
+             H5WriteOptions options = H5WriteOptions(),
+             ItemCompletion* completion = nullptr) {
+    Submit(std::make_unique<DumpRequest<T, std::unique_ptr<T[], Deleter>>>(
+               std::move(path), std::move(buffer), shape, std::move(options)),
+           completion);
+  }
+
+  // Append a frame to the growing dataset at path. The dataset is created
+  // on the first append with stream_options(), its frame shape is the
+  // shape of that first frame, and it is finalised by CloseStream() or the
+  // destructor. Once it exists, Append() also takes frames stacked along a
+  // new first axis.
+  template <typename T>
+  void Append(std::string path, xt::xarray<T> frame,
+              ItemCompletion* completion = nullptr) {
+    Submit(std::make_unique<AppendRequest<T>>(std::move(path),
+                                              std::move(frame), false),
+           completion);
+  }
+  // Append frames stacked along a new first axis, also as the first
+  // append: the frame shape is then frames.shape() without the first axis.
+  template <typename T>
+  void AppendFrames(std::string path, xt::xarray<T> frames,
+                    ItemCompletion* completion = nullptr) {
+    Submit(std::make_unique<AppendRequest<T>>(std::move(path),
+                                              std::move(frames), true),
+           completion);
+  }
+  void CloseStream(std::string path, ItemCompletion* completion = nullptr) {
+    Submit(std::make_unique<CloseStreamRequest>(std::move(path)), completion);
+  }
+
+  // Block until every request submitted before is written and the file is
+  // flushed. Rethrows if the flush fails or the writer has stopped.
+  void Flush() {
+    ItemCompletion completion;
+    Submit(std::make_unique<FlushRequest>(), &completion);
+    completion.Wait();
+  }
+
+  // Call before the first Append() or AppendFrames() to a dataset.
+  void set_stream_options(H5WriteOptions options,
+                          size_t frames_per_extend = 64) {
+    stream_options_ = std::move(options);
+    frames_per_extend_ = frames_per_extend;
+  }
+  // Flush the file after every batch, not only on Flush().
+  void set_flush_each_batch(bool flag_flush_each_batch) {
+    flag_flush_each_batch_ = flag_flush_each_batch;
+  }
+  // Level HandleException() sees for a failed write. E_ERROR stops the
+  // writer, the requests after it fail until it is started again.
+  void set_write_error_level(ErrorLevel level) { write_error_level_ = level; }
+  ErrorLevel write_error_level() const { return write_error_level_; }
+
+  // Only on the consumer thread, for H5WriteRequest implementations. The
+  // file is locked while a request runs.
+  HighFive::File& file() { return file_.get(); }
+  template <typename T>
+  H5StreamWriter<T>& stream(const std::string& path,
+                            const std::vector<size_t>& frame_shape) {
+    auto iter = streams_.find(path);
+    if (iter == streams_.end()) {
+      auto holder = std::make_unique<StreamHolder<T>>(
+          file_, path, frame_shape, stream_options_, frames_per_extend_);
+      iter = streams_.emplace(path, std::move(holder)).first;
+    }
+    auto* holder = dynamic_cast<StreamHolder<T>*>(iter->second.get());
+    if (holder == nullptr) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Stream " + path +
+                                " was opened with another element type."),
+          ErrorLevel::E_ERROR);
+    }
+    return holder->writer;
+  }
+  void CloseStreamNow(const std::string& path) {
+    auto iter = streams_.find(path);
+    if (iter != streams_.end()) {
+      auto holder = std::move(iter->second);
+      streams_.erase(iter);
+      holder->Close();
+    }
+  }
+
+ protected:
+  void Submit(std::unique_ptr<H5WriteRequest> request,
+              ItemCompletion* completion) {
+    if (completion) {
+      ProcessDataAsync(std::move(request), *completion);
+    } else {
+      ProcessDataAsync(std::move(request));
+    }
+  }
+
+  virtual void ProcessData() {
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    RunRequest(*loaded_data_);
+    loaded_data_.reset();
+    if (flag_flush_each_batch_) {
+      file_.get().flush();
+    }
+  }
+  // Every request completes on its own, the first error is rethrown once
+  // the whole batch has been written. The completions run after the file
+  // is unlocked, so a resumed coroutine may open other files.
+  virtual void ProcessBatch() {
+    std::vector<boost::exception_ptr> errors(loaded_batch_.size());
+    boost::exception_ptr first_error;
+    {
+      // One lock per batch, other files only wait for the batch in progress.
+      SafeHighFiveFile::ScopedLock lock = file_.Lock();
+      std::size_t i = 0;
+      while (i < loaded_batch_.size()) {
+        std::size_t first = i++;
+        while (i < loaded_batch_.size() &&
+               loaded_batch_[first]->Merge(*loaded_batch_[i])) {
+          i++;
+        }
+        try {
+          RunRequest(*loaded_batch_[first]);
+        } catch (...) {
+          errors[first] = boost::current_exception();
+          if (!first_error) {
+            first_error = errors[first];
+          }
+        }
+        for (std::size_t j = first + 1; j < i; j++) {
+          errors[j] = errors[first];
+        }
+      }
+      loaded_batch_.clear();
+      try {
+        if (flag_flush_each_batch_) {
+          file_.get().flush();
+        }
+      } catch (...) {
+        if (!first_error) {
+          first_error = boost::current_exception();
+        }
+      }
+    }
+    for (std::size_t j = 0; j < errors.size(); j++) {
+      if (loaded_batch_completions_[j]) {
+        loaded_batch_completions_[j]->Complete(errors[j]);
+        loaded_batch_completions_[j] = nullptr;
+      }
+    }
+    if (first_error) {
+      boost::rethrow_exception(first_error);
+    }
+  }
+
+ private:
+  template <typename T, typename Buffer = xt::xarray<T>>
+  class DumpRequest : public H5WriteRequest {
+   public:
+    DumpRequest(std::string path, xt::xarray<T>&& data,
+                H5WriteOptions&& options)
+        : path_(std::move(path)),
+          buffer_(std::move(data)),
+          shape_(buffer_.shape().begin(), buffer_.shape().end()),
+          options_(std::move(options)) {}
+    DumpRequest(std::string path, Buffer&& buffer,
+                const std::vector<size_t>& shape, H5WriteOptions&& options)
+        : path_(std::move(path)),
+          buffer_(std::move(buffer)),
+          shape_(shape),
+          options_(std::move(options)) {}
+    void Run(AsyncH5Writer& writer) override {
+      HighFive::File& file = writer.file();
+      if (options_.flag_overwrite && file.exist(path_)) {
+        file.unlink(path_);
+      }
+      HighFive::DataSet dataset = file.createDataSet<T>(
+          path_, HighFive::DataSpace(shape_),
+          MakeDataSetCreateProps<T>(shape_, options_));
+      size_t size = 1;
+      for (auto dim : shape_) {
+        size *= dim;
+      }
+      if (size > 0) {
+        dataset.write_raw(DataOf(buffer_));
+      }
+    }
+
+   private:
+    static const T* DataOf(const xt::xarray<T>& data) { return data.data(); }
+    template <typename Pointer>
+    static const T* DataOf(const Pointer& data) { return data.get(); }
+
+    std::string path_;
+    Buffer buffer_;
+    std::vector<size_t> shape_;
+    H5WriteOptions options_;
+  };
+
+  template <typename T>
+  class AppendRequest : public H5WriteRequest {
+   public:
+    AppendRequest(std::string path, xt::xarray<T>&& frames, bool flag_stacked)
+        : path_(std::move(path)), flag_stacked_(flag_stacked) {
+      blocks_.push_back(std::move(frames));
+    }
+    bool Merge(H5WriteRequest& next) override {
+      auto* other = dynamic_cast<AppendRequest<T>*>(&next);
+      if (other == nullptr || other->path_ != path_ ||
+          other->flag_stacked_ != flag_stacked_ ||
+          other->blocks_.front().shape() != blocks_.front().shape()) {
+        return false;
+      }
+      for (auto& block : other->blocks_) {
+        blocks_.push_back(std::move(block));
+      }
+      other->blocks_.clear();
+      return true;
+    }
+    void Run(AsyncH5Writer& writer) override {
+      const auto& shape = blocks_.front().shape();
+      std::vector<size_t> block_shape(shape.begin(), shape.end());
+      // The first append to a dataset sets its frame shape.
+      std::vector<size_t> frame_shape = block_shape;
+      if (flag_stacked_) {
+        if (frame_shape.empty()) {
+          CPPTOOLKIT_THROW_EXCEPTION(
+              std::invalid_argument("Stacked frames for " + path_ +
+                                    " need at least one axis."),
+              ErrorLevel::E_ERROR);
+        }
+        frame_shape.erase(frame_shape.begin());
+      }
+      H5StreamWriter<T>& stream = writer.stream<T>(path_, frame_shape);
+      if (blocks_.size() == 1) {
+        stream.Append(blocks_.front());
+        return;
+      }
+      size_t frames_per_block = 1;
+      if (block_shape != stream.frame_shape()) {
+        // Blocks of several frames, check the shape as Append() would.
+        if (block_shape.empty() ||
+            std::vector<size_t>(block_shape.begin() + 1, block_shape.end()) !=
+                stream.frame_shape()) {
+          CPPTOOLKIT_THROW_EXCEPTION(
+              std::invalid_argument("Block shape does not match the frame "
+                                    "shape of " + path_ + "."),
+              ErrorLevel::E_ERROR);
+        }
+        frames_per_block = block_shape.front();
+      }
+      // Stage the merged blocks, one write is cheaper than many small ones.
+      size_t block_size = blocks_.front().size();
+      staging_.resize(block_size * blocks_.size());
+      for (size_t i = 0; i < blocks_.size(); i++) {
+        std::memcpy(staging_.data() + i * block_size, blocks_[i].data(),
+                    block_size * sizeof(T));
+      }
+      stream.Append(staging_.data(), frames_per_block * blocks_.size());
+    }
+
+   private:
+    std::string path_;
+    bool flag_stacked_;
+    std::vector<xt::xarray<T>> blocks_;
+    std::vector<T> staging_;
+  };
+
+  class CloseStreamRequest : public H5WriteRequest {
+   public:
+    explicit CloseStreamRequest(std::string path) : path_(std::move(path)) {}
+    void Run(AsyncH5Writer& writer) override { writer.CloseStreamNow(path_); }
+
+   private:
+    std::string path_;
+  };
+
+  class FlushRequest : public H5WriteRequest {
+   public:
+    void Run(AsyncH5Writer& writer) override { writer.file().flush(); }
+  };
+
+  struct StreamHolderBase {
+    virtual ~StreamHolderBase() = default;
+    virtual void Close() = 0;
+  };
+  template <typename T>
+  struct StreamHolder : StreamHolderBase {
+    StreamHolder(SafeHighFiveFile& file, const std::string& path,
+                 const std::vector<size_t>& frame_shape,
+                 const H5WriteOptions& options, size_t frames_per_extend)
+        : writer(file, path, frame_shape, options, frames_per_extend) {}
+    void Close() override { writer.Close(); }
+    H5StreamWriter<T> writer;
+  };
+
+  void RunRequest(H5WriteRequest& request) {
+    try {
+      request.Run(*this);
+    } catch (const boost::exception&) {
+      throw;
+    } catch (const std::exception& e) {
+      // HighFive errors carry no ErrorLevel, give them write_error_level_.
+      CPPTOOLKIT_THROW_EXCEPTION(std::runtime_error(e.what()),
+                                 write_error_level_);
+    }
+  }
+  void CloseStreams() {
+    for (auto& pair : streams_) {
+      try {
+        pair.second->Close();
+      } catch (...) {
+        LOG_ERROR("[AsyncH5Writer]Failed to close stream {}: {}", pair.first,
+                  boost::current_exception_diagnostic_information());
+      }
+    }
+    streams_.clear();
+  }
+
+  // Declared first, so the streams are closed before the file.
+  SafeHighFiveFile file_;
+  std::map<std::string, std::unique_ptr<StreamHolderBase>> streams_;
+  H5WriteOptions stream_options_ = H5WriteOptions::Compressed(1);
+  size_t frames_per_extend_ = 64;
+  bool flag_flush_each_batch_ = false;
+  ErrorLevel write_error_level_ = ErrorLevel::E_WARNING;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_ASYNC_H5_WRITER_H_
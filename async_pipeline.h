@@ -0,0 +1,210 @@
+/*
+ * async_pipeline.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * Pipeline chains AsyncConsumers into multi-stage DAGs.
+ *   A PipelineStage<In, Out> is a RingAsyncConsumer of std::unique_ptr<In>
+ *   buffers. It transforms every buffer on its consumer thread and moves the
+ *   result into the stages it is connected to, so a hand-off never copies.
+ *   Connecting a stage to several stages fans out (round-robin, or
+ *   broadcast with one copy per extra output); connecting several stages to
+ *   one stage fans in. PipelineSource feeds the first stages from the
+ *   acquisition thread and PipelineSink ends a branch.
+ *   Pipeline::Shutdown() closes the stages in the order they were added,
+ *   so each stage drains its buffer (stop_loop + CleanUpBuffer) into
+ *   downstream stages that are still running. Add stages upstream first.
+ *
+ * Usage example:
+ *
+ *     Pipeline pipeline;
+ *     auto& source = pipeline.AddStage<PipelineSource<Frame>>();
+ *     auto& preprocess = pipeline.AddStage<Preprocess>();  // Frame -> Frame
+ *     auto& writer = pipeline.AddStage<H5Writer>();        // sink of Frame
+ *     source.ConnectTo(preprocess);
+ *     preprocess.ConnectTo(writer);
+ *     pipeline.Init();
+ *     source.Emit(std::make_unique<Frame>(...));
+ *     pipeline.Shutdown();
+ */
+
+#ifndef CPPTOOLKIT_ASYNC_PIPELINE_H_
+#define CPPTOOLKIT_ASYNC_PIPELINE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "ring_async_consumer.h"
+
+namespace cpptoolkit {
+
+// How a stage with several outputs distributes its buffers.
+enum class FanOutMode {
+  kRoundRobin,  // Each buffer is moved to one output in turn.
+  kBroadcast    // Each output gets the buffer, copied for all but the last.
+};
+
+// Node of a Pipeline, used to start and drain the stages in order.
+class PipelineNode {
+ public:
+  virtual ~PipelineNode() = default;
+  virtual void Init() = 0;
+  virtual void Drain() = 0;
+};
+
+// Typed input port of a stage.
+template <typename In>
+class PipelineInput {
+ public:
+  virtual ~PipelineInput() = default;
+  virtual void Push(std::unique_ptr<In> data) = 0;
+};
+
+// Typed output port, connect it to the inputs of downstream stages before
+// the pipeline is started.
+template <typename Out>
+class PipelineOutput {
+ public:
+  void ConnectTo(PipelineInput<Out>& downstream) {
+    outputs_.push_back(&downstream);
+  }
+  // The mode is a template argument so that kBroadcast, which copies the
+  // buffers, fails to compile for a non-copyable Out.
+  template <FanOutMode kMode>
+  void set_fan_out_mode() {
+    static_assert(kMode != FanOutMode::kBroadcast ||
+                      std::is_copy_constructible<Out>::value,
+                  "FanOutMode::kBroadcast needs a copyable type.");
+    fan_out_mode_ = kMode;
+  }
+
+  // Move data to the connected stages. Dropped if nothing is connected.
+  void Emit(std::unique_ptr<Out> data);
+
+ private:
+  std::vector<PipelineInput<Out>*> outputs_;
+  FanOutMode fan_out_mode_ = FanOutMode::kRoundRobin;
+  std::atomic<std::size_t> next_output_{0};
+};
+
+template <typename Out>
+void PipelineOutput<Out>::Emit(std::unique_ptr<Out> data) {
+  if (outputs_.empty() || !data) {
+    return;
+  }
+  if (fan_out_mode_ == FanOutMode::kRoundRobin || outputs_.size() == 1) {
+    std::size_t index =
+        next_output_.fetch_add(1, std::memory_order_relaxed) % outputs_.size();
+    outputs_[index]->Push(std::move(data));
+    return;
+  }
+  // Only reachable for a copyable Out, see set_fan_out_mode().
+  if constexpr (std::is_copy_constructible<Out>::value) {
+    for (std::size_t i = 0; i + 1 < outputs_.size(); i++) {
+      outputs_[i]->Push(std::make_unique<Out>(*data));
+    }
+    outputs_.back()->Push(std::move(data));
+  }
+}
+
+// Entry point of a pipeline, Emit() from the acquisition thread.
+template <typename Out>
+class PipelineSource : public PipelineNode, public PipelineOutput<Out> {
+ public:
+  void Init() override {}
+  void Drain() override {}
+};
+
+template <typename In, typename Out>
+class PipelineStage : public RingAsyncConsumer<std::unique_ptr<In>>,
+                      public PipelineNode,
+                      public PipelineInput<In>,
+                      public PipelineOutput<Out> {
+ public:
+  explicit PipelineStage(std::size_t capacity = 1024)
+      : RingAsyncConsumer<std::unique_ptr<In>>(capacity) {}
+  virtual ~PipelineStage() { this->Close(); };
+
+  void Init() override { RingAsyncConsumer<std::unique_ptr<In>>::Init(); }
+  void Drain() override { this->Close(); }
+  void Push(std::unique_ptr<In> data) override {
+    this->ProcessDataAsync(std::move(data));
+  }
+
+ protected:
+  // Runs on the consumer thread. Return nullptr to emit nothing.
+  virtual std::unique_ptr<Out> Transform(std::unique_ptr<In> data) = 0;
+
+  virtual void ProcessData() {
+    std::unique_ptr<Out> result = Transform(std::move(this->loaded_data_));
+    if (result) {
+      this->Emit(std::move(result));
+    }
+  }
+};
+
+// Last stage of a branch.
+template <typename In>
+class PipelineSink : public RingAsyncConsumer<std::unique_ptr<In>>,
+                     public PipelineNode,
+                     public PipelineInput<In> {
+ public:
+  explicit PipelineSink(std::size_t capacity = 1024)
+      : RingAsyncConsumer<std::unique_ptr<In>>(capacity) {}
+  virtual ~PipelineSink() { this->Close(); };
+
+  void Init() override { RingAsyncConsumer<std::unique_ptr<In>>::Init(); }
+  void Drain() override { this->Close(); }
+  void Push(std::unique_ptr<In> data) override {
+    this->ProcessDataAsync(std::move(data));
+  }
+
+ protected:
+  // Runs on the consumer thread.
+  virtual void Consume(std::unique_ptr<In> data) = 0;
+
+  virtual void ProcessData() { Consume(std::move(this->loaded_data_)); }
+};
+
+class Pipeline {
+ public:
+  Pipeline() = default;
+  ~Pipeline() { Shutdown(); }
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  // Stages are owned by the pipeline. Add them upstream first.
+  template <typename Stage, typename... Args>
+  Stage& AddStage(Args&&... args) {
+    auto stage = std::make_unique<Stage>(std::forward<Args>(args)...);
+    Stage& ref = *stage;
+    nodes_.push_back(std::move(stage));
+    return ref;
+  }
+
+  void Init() {
+    for (auto& node : nodes_) {
+      node->Init();
+    }
+  }
+
+  // Drain every stage in the order they were added. Data still buffered in
+  // a stage is processed and handed downstream before the next one stops.
+  void Shutdown() {
+    for (auto& node : nodes_) {
+      node->Drain();
+    }
+  }
+
+ private:
+  std::vector<std::unique_ptr<PipelineNode>> nodes_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_ASYNC_PIPELINE_H_
@@ -0,0 +1,507 @@
+/*
+ * hdf5_toolkit_benchmark.cpp
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * Benchmark of the read and write paths of hdf5_toolkit.
+ *   Every case generates its own synthetic data in a temporary directory,
+ *   which is removed afterwards, so no data files are needed. The cases
+ *   cover dataset sizes, element types, layouts (contiguous, chunked,
+ *   compressed), group fan-outs and thread counts for
+ *     save_data_to_h5, H5WriteScheduler, whole-dataset and frame-by-frame
+ *     reads, LoadGroupToMap and opening a SafeHighFiveFile.
+ *   The xt_dump cases write the same stacks with plain xt::dump(), the
+ *   baseline for the save_data_to_h5 layouts.
+ *   H5WriteScheduler shuffles and deflates the chunks itself and bypasses
+ *   the HDF5 filters on write, so the write_scheduler cases read their
+ *   first file back through HDF5, with frame-sized and with edge chunks,
+ *   and fail the run if it differs from what was written.
+ *   The results go to stdout, or --output, as one JSON document with MB/s,
+ *   ops/s and latency percentiles of every case, and the file size and
+ *   compression ratio of every write case.
+ *
+ * Build on Linux from the directory that holds CppToolkit/, with HighFive,
+ * xtensor, xtensor-io, spdlog and fmt on the include path, e.g.
+ *
+ *     g++ -O2 -std=c++17 -DH5_USE_XTENSOR -I. $(pkg-config --cflags hdf5) \
+ *         CppToolkit/benchmark/hdf5_toolkit_benchmark.cpp \
+ *         CppToolkit/thread_pool.cpp $(pkg-config --libs hdf5) -lz \
+ *         -lspdlog -lfmt -lpthread -o hdf5_toolkit_benchmark
+ *
+ * pkg-config finds distribution builds of HDF5 that live outside the
+ * default paths, e.g. /usr/include/hdf5/serial on Debian and Ubuntu.
+ *
+ * Usage:
+ *
+ *     hdf5_toolkit_benchmark [--quick] [--repeat N] [--dir DIR]
+ *                            [--output FILE]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <CppToolkit/h5_chunk_cache_reader.h>
+#include <CppToolkit/h5_write_scheduler.h>
+#include <CppToolkit/hdf5_toolkit_core.h>
+#include <CppToolkit/thread_pool.h>
+
+namespace {
+
+using namespace cpptoolkit;
+using Clock = std::chrono::steady_clock;
+
+struct Config {
+  bool flag_quick = false;
+  int repeat = 5;
+  std::filesystem::path dir;
+  std::string output;
+};
+
+struct Result {
+  std::string name;
+  std::vector<std::pair<std::string, std::string>> params;
+  double bytes_per_op = 0;
+  double file_bytes = 0;  // size of the written file, 0 for reads
+  std::vector<double> seconds;  // one sample per op
+};
+
+double Percentile(std::vector<double> samples, double fraction) {
+  if (samples.empty()) {
+    return 0;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t index = static_cast<size_t>(fraction * (samples.size() - 1) + 0.5);
+  return samples[index];
+}
+
+template <typename F>
+double Seconds(F&& func) {
+  auto begin = Clock::now();
+  func();
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+std::string ToJson(const std::vector<Result>& results) {
+  std::ostringstream ss;
+  ss << "{\n  \"hardware_concurrency\": " << std::thread::hardware_concurrency()
+     << ",\n  \"hdf5_threadsafe\": "
+#ifdef H5_HAVE_THREADSAFE
+     << "true"
+#else
+     << "false"
+#endif
+     << ",\n  \"direct_chunk_write\": "
+     << (H5WriteScheduler::is_direct_chunk_write_available() ? "true"
+                                                             : "false")
+     << ",\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& result = results[i];
+    double total = 0;
+    for (double s : result.seconds) {
+      total += s;
+    }
+    double median = Percentile(result.seconds, 0.5);
+    ss << (i > 0 ? "," : "") << "\n    {\"name\": \"" << result.name
+       << "\", \"params\": {";
+    for (size_t j = 0; j < result.params.size(); j++) {
+      ss << (j > 0 ? ", " : "") << "\"" << result.params[j].first << "\": \""
+         << result.params[j].second << "\"";
+    }
+    ss << "}, \"samples\": " << result.seconds.size()
+       << ", \"mb_per_s\": "
+       << (median > 0 ? result.bytes_per_op / median / 1e6 : 0)
+       << ", \"ops_per_s\": "
+       << (total > 0 ? result.seconds.size() / total : 0);
+    if (result.file_bytes > 0) {
+      ss << ", \"file_bytes\": " << result.file_bytes
+         << ", \"compression_ratio\": "
+         << result.bytes_per_op / result.file_bytes;
+    }
+    ss << ", \"latency_us\": {\"p50\": " << median * 1e6
+       << ", \"p90\": " << Percentile(result.seconds, 0.9) * 1e6
+       << ", \"p99\": " << Percentile(result.seconds, 0.99) * 1e6
+       << ", \"max\": " << Percentile(result.seconds, 1.0) * 1e6 << "}}";
+  }
+  ss << "\n  ]\n}\n";
+  return ss.str();
+}
+
+// Smooth data with some noise, compresses like a real image stack.
+template <typename T>
+xt::xarray<T> MakeStack(size_t frames, size_t height, size_t width) {
+  xt::xarray<T> stack(std::vector<size_t>{frames, height, width});
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> noise(0, 15);
+  for (size_t i = 0; i < stack.size(); i++) {
+    stack.data()[i] = static_cast<T>((i % width) / 4 + noise(rng));
+  }
+  return stack;
+}
+
+struct Layout {
+  const char* name;
+  H5WriteOptions options;
+};
+std::vector<Layout> Layouts(size_t height, size_t width) {
+  H5WriteOptions chunked;
+  chunked.flag_chunked = true;
+  chunked.chunk_shape = {1, height, width};
+  H5WriteOptions compressed = H5WriteOptions::Compressed(1);
+  compressed.chunk_shape = {1, height, width};
+  return {{"contiguous", H5WriteOptions()},
+          {"chunked", chunked},
+          {"deflate1_shuffle", compressed}};
+}
+
+class Benchmark {
+ public:
+  explicit Benchmark(const Config& config) : config_(config) {}
+
+  std::vector<Result> Run() {
+    std::vector<size_t> frame_counts =
+        config_.flag_quick ? std::vector<size_t>{4, 32}
+                           : std::vector<size_t>{4, 32, 256};
+    for (size_t frames : frame_counts) {
+      RunWrite<uint16_t>("uint16", frames);
+      RunWrite<float>("float32", frames);
+      RunWrite<double>("float64", frames);
+      RunRead<uint16_t>("uint16", frames);
+    }
+    RunWriteScheduler();
+    std::vector<size_t> fan_outs = config_.flag_quick
+                                       ? std::vector<size_t>{16, 256}
+                                       : std::vector<size_t>{16, 256, 4096};
+    for (size_t fan_out : fan_outs) {
+      RunLoadGroup(fan_out);
+    }
+    RunSafeFileOpen();
+    return std::move(results_);
+  }
+
+ private:
+  static constexpr size_t kHeight = 512;
+  static constexpr size_t kWidth = 512;
+
+  std::string NewFile() {
+    return (config_.dir / ("bench_" + std::to_string(file_index_++) + ".h5"))
+        .string();
+  }
+  std::vector<size_t> ThreadCounts() const {
+    std::vector<size_t> counts{1, 2, 4};
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    if (hardware > 4) {
+      counts.push_back(hardware);
+    }
+    return counts;
+  }
+  static double FileBytes(const std::string& filename) {
+    return static_cast<double>(std::filesystem::file_size(filename));
+  }
+  void Report(Result result) {
+    std::cerr << result.name;
+    for (const auto& param : result.params) {
+      std::cerr << " " << param.first << "=" << param.second;
+    }
+    std::cerr << " p50 " << Percentile(result.seconds, 0.5) * 1e3 << " ms";
+    if (result.file_bytes > 0) {
+      std::cerr << ", " << result.file_bytes / 1e6 << " MB on disk";
+    }
+    std::cerr << "\n";
+    results_.push_back(std::move(result));
+  }
+
+  template <typename T>
+  void RunWrite(const char* dtype, size_t frames) {
+    xt::xarray<T> stack = MakeStack<T>(frames, kHeight, kWidth);
+    // Baseline, plain xt::dump() as the toolkit wrote before H5WriteOptions.
+    Result baseline;
+    baseline.name = "xt_dump";
+    baseline.params = {{"dtype", dtype},
+                       {"shape", std::to_string(frames) + "x512x512"},
+                       {"layout", "contiguous"}};
+    baseline.bytes_per_op = static_cast<double>(stack.size() * sizeof(T));
+    for (int i = 0; i < config_.repeat; i++) {
+      std::string filename = NewFile();
+      baseline.seconds.push_back(Seconds([&] {
+        HighFive::File file(filename, HighFive::File::Overwrite);
+        xt::dump(file, "/stack", stack);
+        file.flush();
+      }));
+      baseline.file_bytes = FileBytes(filename);
+      std::filesystem::remove(filename);
+    }
+    Report(std::move(baseline));
+    for (const Layout& layout : Layouts(kHeight, kWidth)) {
+      Result result;
+      result.name = "save_data_to_h5";
+      result.params = {{"dtype", dtype},
+                       {"shape", std::to_string(frames) + "x512x512"},
+                       {"layout", layout.name}};
+      result.bytes_per_op = static_cast<double>(stack.size() * sizeof(T));
+      for (int i = 0; i < config_.repeat; i++) {
+        std::string filename = NewFile();
+        result.seconds.push_back(Seconds([&] {
+          HighFive::File file(filename, HighFive::File::Overwrite);
+          save_data_to_h5(file, "/", "stack", stack, layout.options);
+          file.flush();
+        }));
+        result.file_bytes = FileBytes(filename);
+        std::filesystem::remove(filename);
+      }
+      Report(std::move(result));
+    }
+  }
+
+  template <typename T>
+  void RunRead(const char* dtype, size_t frames) {
+    xt::xarray<T> stack = MakeStack<T>(frames, kHeight, kWidth);
+    for (const Layout& layout : Layouts(kHeight, kWidth)) {
+      std::string filename = NewFile();
+      {
+        HighFive::File file(filename, HighFive::File::Overwrite);
+        save_data_to_h5(file, "/", "stack", stack, layout.options);
+      }
+      std::vector<std::pair<std::string, std::string>> params = {
+          {"dtype", dtype},
+          {"shape", std::to_string(frames) + "x512x512"},
+          {"layout", layout.name}};
+
+      Result whole;
+      whole.name = "read_dataset";
+      whole.params = params;
+      whole.bytes_per_op = static_cast<double>(stack.size() * sizeof(T));
+      xt::xarray<T> buffer(stack.shape());
+      for (int i = 0; i < config_.repeat; i++) {
+        whole.seconds.push_back(Seconds([&] {
+          HighFive::File file(filename, HighFive::File::ReadOnly);
+          file.getDataSet("/stack").read_raw(buffer.data());
+        }));
+      }
+      Report(std::move(whole));
+
+      if (layout.options.flag_chunked) {
+        // Sequential playback, one sample per frame.
+        Result playback;
+        playback.name = "chunk_cache_reader_frame";
+        playback.params = params;
+        playback.bytes_per_op = static_cast<double>(kHeight * kWidth *
+                                                    sizeof(T));
+        for (int i = 0; i < config_.repeat; i++) {
+          H5ChunkCacheReader<T> reader(filename, "/stack");
+          for (size_t frame = 0; frame < frames; frame++) {
+            playback.seconds.push_back(
+                Seconds([&] { reader.ReadFrame(frame); }));
+          }
+        }
+        Report(std::move(playback));
+      }
+      std::filesystem::remove(filename);
+    }
+  }
+
+  void RunWriteScheduler() {
+    size_t frames = config_.flag_quick ? 16 : 64;
+    xt::xarray<uint16_t> stack = MakeStack<uint16_t>(frames, kHeight, kWidth);
+    H5WriteOptions options = H5WriteOptions::Compressed(1);
+    options.chunk_shape = {1, kHeight, kWidth};
+    RunWriteScheduler(stack, "deflate1_shuffle", options);
+    // Chunks that do not divide the shape, the edge chunks are partial.
+    options.chunk_shape = {3, 200, 300};
+    RunWriteScheduler(stack, "deflate1_shuffle_edge_chunks", options);
+  }
+  void RunWriteScheduler(const xt::xarray<uint16_t>& stack,
+                         const std::string& layout,
+                         const H5WriteOptions& options) {
+    size_t number_of_datasets = 8;
+    for (size_t threads : ThreadCounts()) {
+      ThreadPool pool(threads);
+      Result result;
+      result.name = "write_scheduler";
+      result.params = {{"dtype", "uint16"},
+                       {"datasets", std::to_string(number_of_datasets)},
+                       {"shape", std::to_string(stack.shape()[0]) + "x512x512"},
+                       {"layout", layout},
+                       {"threads", std::to_string(threads)}};
+      result.bytes_per_op = static_cast<double>(
+          number_of_datasets * stack.size() * sizeof(uint16_t));
+      for (int i = 0; i < config_.repeat; i++) {
+        std::string filename = NewFile();
+        result.seconds.push_back(Seconds([&] {
+          HighFive::File file(filename, HighFive::File::Overwrite);
+          H5WriteScheduler scheduler(file, pool);
+          for (size_t j = 0; j < number_of_datasets; j++) {
+            scheduler.Add("/", "stack" + std::to_string(j), stack, options);
+          }
+          scheduler.Run();
+          file.flush();
+        }));
+        result.file_bytes = FileBytes(filename);
+        if (i == 0) {
+          VerifyReadBack(filename, number_of_datasets, stack);
+        }
+        std::filesystem::remove(filename);
+      }
+      Report(std::move(result));
+    }
+  }
+
+  // Read the datasets of a write_scheduler file back through HDF5 and its
+  // filters, throws if one differs from stack.
+  static void VerifyReadBack(const std::string& filename,
+                             size_t number_of_datasets,
+                             const xt::xarray<uint16_t>& stack) {
+    HighFive::File file(filename, HighFive::File::ReadOnly);
+    for (size_t j = 0; j < number_of_datasets; j++) {
+      std::string name = "/stack" + std::to_string(j);
+      HighFive::DataSet dataset = file.getDataSet(name);
+      xt::xarray<uint16_t> read_back(dataset.getDimensions());
+      if (read_back.shape() != stack.shape()) {
+        throw std::runtime_error("Read-back shape of " + name + " differs.");
+      }
+      dataset.read_raw(read_back.data());
+      if (read_back != stack) {
+        throw std::runtime_error("Read-back of " + name + " differs from " +
+                                 "what H5WriteScheduler wrote.");
+      }
+    }
+  }
+
+  void RunLoadGroup(size_t fan_out) {
+    std::string filename = NewFile();
+    size_t elements = 1024;
+    {
+      HighFive::File file(filename, HighFive::File::Overwrite);
+      xt::xarray<float> value = xt::xarray<float>::from_shape({elements});
+      std::fill(value.begin(), value.end(), 1.0f);
+      for (size_t i = 0; i < fan_out; i++) {
+        save_data_to_h5(file, "/group/", std::to_string(i), value);
+      }
+    }
+    std::vector<size_t> thread_counts = ThreadCounts();
+    thread_counts.insert(thread_counts.begin(), 0);  // no pool
+    for (size_t threads : thread_counts) {
+      std::unique_ptr<ThreadPool> pool;
+      if (threads > 0) {
+        pool = std::make_unique<ThreadPool>(threads);
+      }
+      Result result;
+      result.name = "load_group_to_map";
+      result.params = {{"dtype", "float32"},
+                       {"fan_out", std::to_string(fan_out)},
+                       {"elements", std::to_string(elements)},
+                       {"threads", std::to_string(threads)}};
+      result.bytes_per_op =
+          static_cast<double>(fan_out * elements * sizeof(float));
+      for (int i = 0; i < config_.repeat; i++) {
+        result.seconds.push_back(Seconds([&] {
+          LoadGroupToMap<float, int>(filename, "/group", pool.get());
+        }));
+      }
+      Report(std::move(result));
+    }
+    std::filesystem::remove(filename);
+  }
+
+  // Open and close a read-only SafeHighFiveFile from several threads, one
+  // sample per open.
+  void RunSafeFileOpen() {
+    std::string filename = NewFile();
+    {
+      HighFive::File file(filename, HighFive::File::Overwrite);
+      save_data_to_h5(file, "/", "value", xt::xarray<int>({1}));
+    }
+    size_t opens_per_thread = config_.flag_quick ? 100 : 1000;
+    for (H5LockMode mode : {H5LockMode::kGlobal, H5LockMode::kPerFile}) {
+      SafeHighFiveFile::set_lock_mode(mode);
+      for (size_t threads : ThreadCounts()) {
+        Result result;
+        result.name = "safe_file_open";
+        result.params = {
+            {"lock_mode", mode == H5LockMode::kGlobal ? "global" : "per_file"},
+            {"threads", std::to_string(threads)}};
+        std::vector<std::vector<double>> samples(threads);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; t++) {
+          workers.emplace_back([&, t] {
+            for (size_t i = 0; i < opens_per_thread; i++) {
+              samples[t].push_back(Seconds([&] {
+                SafeHighFiveFile file(filename, HighFive::File::ReadOnly);
+              }));
+            }
+          });
+        }
+        for (auto& worker : workers) {
+          worker.join();
+        }
+        for (const auto& thread_samples : samples) {
+          result.seconds.insert(result.seconds.end(), thread_samples.begin(),
+                                thread_samples.end());
+        }
+        Report(std::move(result));
+      }
+    }
+    std::filesystem::remove(filename);
+  }
+
+  const Config config_;
+  std::vector<Result> results_;
+  size_t file_index_ = 0;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Config config;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--quick") {
+      config.flag_quick = true;
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      config.repeat = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--dir" && i + 1 < argc) {
+      config.dir = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      config.output = argv[++i];
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--quick] [--repeat N] [--dir DIR] [--output FILE]\n";
+      return 2;
+    }
+  }
+  std::filesystem::path base =
+      config.dir.empty() ? std::filesystem::temp_directory_path() : config.dir;
+  config.dir = base / ("cpptoolkit_h5_benchmark_" +
+                       std::to_string(Clock::now().time_since_epoch().count()));
+  std::filesystem::create_directories(config.dir);
+
+  int status = 0;
+  try {
+    std::string json = ToJson(Benchmark(config).Run());
+    if (config.output.empty()) {
+      std::cout << json;
+    } else {
+      std::ofstream(config.output) << json;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Benchmark failed: " << e.what() << "\n";
+    status = 1;
+  }
+  std::error_code error;
+  std::filesystem::remove_all(config.dir, error);
+  return status;
+}
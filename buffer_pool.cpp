@@ -0,0 +1,73 @@
+#include "buffer_pool.h"
+#include <cstdlib>
+#ifdef _WIN32
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace cpptoolkit {
+
+namespace {
+constexpr std::size_t kHugePageSize = 2 * 1024 * 1024;
+
+std::size_t GetPageSize() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+}  // namespace
+
+void* AllocateAlignedBuffer(std::size_t bytes, BufferAlignment alignment) {
+  std::size_t align =
+      alignment == BufferAlignment::kHugePage ? kHugePageSize : kCacheLineSize;
+  // Round up, aligned allocation needs a multiple of the alignment.
+  std::size_t size = (bytes + align - 1) / align * align;
+  if (size == 0) {
+    size = align;
+  }
+#ifdef _WIN32
+  void* ptr = _aligned_malloc(size, align);
+#else
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, align, size) != 0) {
+    ptr = nullptr;
+  }
+#endif
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+#if defined(MADV_HUGEPAGE)
+  if (alignment == BufferAlignment::kHugePage) {
+    madvise(ptr, size, MADV_HUGEPAGE);  // only a hint, ignore failures
+  }
+#endif
+  return ptr;
+}
+
+void FreeAlignedBuffer(void* ptr) {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+void PrefaultBuffer(void* ptr, std::size_t bytes) {
+  static const std::size_t kPageSize = GetPageSize();
+  volatile char* data = static_cast<char*>(ptr);
+  for (std::size_t i = 0; i < bytes; i += kPageSize) {
+    data[i] = 0;
+  }
+  if (bytes > 0) {
+    data[bytes - 1] = 0;
+  }
+}
+
+}  // namespace cpptoolkit
@@ -0,0 +1,189 @@
+/*
+ * buffer_pool.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * BufferPool recycles fixed-size frame buffers, so producers of an
+ *   AsyncConsumer do not allocate and free a frame on every push.
+ *   Buffers are allocated up front, aligned to a cache line or a huge page
+ *   and pre-faulted. Acquire() hands out a PooledBuffer, a std::unique_ptr
+ *   whose deleter puts the buffer back into the lock-free free list, so the
+ *   buffer returns to the pool as soon as the consumer releases it. The
+ *   pool state is shared with the buffers, so buffers may outlive the pool.
+ *
+ * Usage example:
+ *
+ *     BufferPool<uint16_t> pool(width * height, 32);
+ *     class FrameConsumer
+ *         : public RingAsyncConsumer<BufferPool<uint16_t>::PooledBuffer> {
+ *       ...
+ *     };
+ *     auto frame = pool.Acquire();
+ *     camera.ReadFrame(frame.get());
+ *     consumer.ProcessDataAsync(std::move(frame));
+ */
+
+#ifndef CPPTOOLKIT_BUFFER_POOL_H_
+#define CPPTOOLKIT_BUFFER_POOL_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "cache_line.h"
+#include "ring_buffer.h"
+
+namespace cpptoolkit {
+
+enum class BufferAlignment {
+  kCacheLine,  // 64 bytes
+  kHugePage    // 2 MB, and ask the OS for transparent huge pages if it can
+};
+
+struct BufferPoolStatistics {
+  std::uint64_t hits = 0;             // Acquire() served from the pool
+  std::uint64_t misses = 0;           // Acquire() had to allocate
+  std::uint64_t outstanding = 0;      // buffers currently handed out
+  std::uint64_t high_water_mark = 0;  // most buffers handed out at once
+};
+
+// Platform helpers, see buffer_pool.cpp.
+void* AllocateAlignedBuffer(std::size_t bytes, BufferAlignment alignment);
+void FreeAlignedBuffer(void* ptr);
+// Touch every page so the first frame does not take the page faults.
+void PrefaultBuffer(void* ptr, std::size_t bytes);
+
+template <typename T>
+class BufferPool {
+  static_assert(std::is_trivially_default_constructible<T>::value &&
+                    std::is_trivially_destructible<T>::value,
+                "BufferPool only holds trivial element types.");
+
+  struct State;
+
+ public:
+  class Recycler {
+   public:
+    Recycler() = default;
+    explicit Recycler(std::shared_ptr<State> state)
+        : state_(std::move(state)) {}
+    void operator()(T* ptr) const {
+      // Only buffers from Acquire() may be released, and they always come
+      // with the pool state.
+      assert(state_ && "PooledBuffer without a pool.");
+      if (state_) {
+        state_->Release(ptr);
+      }
+    }
+
+   private:
+    std::shared_ptr<State> state_;
+  };
+  using PooledBuffer = std::unique_ptr<T[], Recycler>;
+
+  // buffer_size is the number of T in one buffer. max_pooled_buffers (0
+  // means 2 * initial_buffers + 1, so never 0) is rounded up to a power of
+  // two, the capacity of the free list, see pooled_capacity(). The pool
+  // keeps at most that many free buffers and frees the rest on release.
+  // initial_buffers are allocated now, but no more than the pool keeps.
+  BufferPool(std::size_t buffer_size, std::size_t initial_buffers,
+             BufferAlignment alignment = BufferAlignment::kCacheLine,
+             std::size_t max_pooled_buffers = 0)
+      : state_(std::make_shared<State>(
+            buffer_size, alignment,
+            max_pooled_buffers > 0 ? max_pooled_buffers
+                                   : 2 * initial_buffers + 1)) {
+    for (std::size_t i = 0;
+         i < initial_buffers && i < state_->free_list.capacity(); i++) {
+      T* ptr = state_->Allocate();
+      if (!state_->free_list.try_push(ptr)) {
+        FreeAlignedBuffer(ptr);
+        break;
+      }
+    }
+  }
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Never fails for lack of pooled buffers, a miss allocates a new one.
+  PooledBuffer Acquire() {
+    State& state = *state_;
+    T* ptr = nullptr;
+    if (state.free_list.try_pop(ptr)) {
+      state.hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      ptr = state.Allocate();
+      state.misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::uint64_t outstanding =
+        state.outstanding.fetch_add(1, std::memory_order_relaxed) + 1;
+    std::uint64_t high_water_mark =
+        state.high_water_mark.load(std::memory_order_relaxed);
+    while (outstanding > high_water_mark &&
+           !state.high_water_mark.compare_exchange_weak(
+               high_water_mark, outstanding, std::memory_order_relaxed)) {
+    }
+    return PooledBuffer(ptr, Recycler(state_));
+  }
+
+  BufferPoolStatistics statistics() const {
+    BufferPoolStatistics stats;
+    stats.hits = state_->hits.load(std::memory_order_relaxed);
+    stats.misses = state_->misses.load(std::memory_order_relaxed);
+    stats.outstanding = state_->outstanding.load(std::memory_order_relaxed);
+    stats.high_water_mark =
+        state_->high_water_mark.load(std::memory_order_relaxed);
+    return stats;
+  }
+  std::size_t buffer_size() const { return state_->kBufferSize; }
+  std::size_t pooled_buffers() const { return state_->free_list.size(); }
+  // Most free buffers the pool keeps.
+  std::size_t pooled_capacity() const { return state_->free_list.capacity(); }
+
+ private:
+  struct State {
+    State(std::size_t buffer_size, BufferAlignment alignment,
+          std::size_t max_pooled_buffers)
+        : kBufferSize(buffer_size),
+          kAlignment(alignment),
+          free_list(max_pooled_buffers) {}
+    ~State() {
+      T* ptr = nullptr;
+      while (free_list.try_pop(ptr)) {
+        FreeAlignedBuffer(ptr);
+      }
+    }
+
+    T* Allocate() {
+      std::size_t bytes = kBufferSize * sizeof(T);
+      void* ptr = AllocateAlignedBuffer(bytes, kAlignment);
+      PrefaultBuffer(ptr, bytes);
+      return static_cast<T*>(ptr);
+    }
+    void Release(T* ptr) {
+      outstanding.fetch_sub(1, std::memory_order_relaxed);
+      if (!free_list.try_push(ptr)) {
+        FreeAlignedBuffer(ptr);
+      }
+    }
+
+    const std::size_t kBufferSize;
+    const BufferAlignment kAlignment;
+    RingBuffer<T*> free_list;
+    std::atomic<std::uint64_t> hits{0};
+    std::atomic<std::uint64_t> misses{0};
+    std::atomic<std::uint64_t> outstanding{0};
+    std::atomic<std::uint64_t> high_water_mark{0};
+  };
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_BUFFER_POOL_H_
@@ -0,0 +1,24 @@
+/*
+ * cache_line.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * Cache line size shared by the classes that pad their members against
+ *   false sharing.
+ */
+
+#ifndef CPPTOOLKIT_CACHE_LINE_H_
+#define CPPTOOLKIT_CACHE_LINE_H_
+
+#include <cstddef>
+
+namespace cpptoolkit {
+
+// Size used to keep independently written atomics on separate cache lines.
+constexpr std::size_t kCacheLineSize = 64;
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_CACHE_LINE_H_
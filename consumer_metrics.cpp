@@ -0,0 +1,98 @@
+#include "consumer_metrics.h"
+#include "log.h"
+
+namespace cpptoolkit {
+
+namespace {
+std::string FormatNanoseconds(double nanoseconds) {
+  if (nanoseconds < 1e3) {
+    return fmt::format("{:.0f}ns", nanoseconds);
+  } else if (nanoseconds < 1e6) {
+    return fmt::format("{:.1f}us", nanoseconds / 1e3);
+  } else if (nanoseconds < 1e9) {
+    return fmt::format("{:.1f}ms", nanoseconds / 1e6);
+  }
+  return fmt::format("{:.2f}s", nanoseconds / 1e9);
+}
+
+std::string FormatHistogram(const HistogramSnapshot& histogram) {
+  return fmt::format("mean {} p50 {} p99 {} max {}",
+                     FormatNanoseconds(histogram.mean_ns()),
+                     FormatNanoseconds(histogram.percentile_ns(50)),
+                     FormatNanoseconds(histogram.percentile_ns(99)),
+                     FormatNanoseconds(static_cast<double>(histogram.max_ns)));
+}
+}  // namespace
+
+std::uint64_t HistogramSnapshot::percentile_ns(double percentile) const {
+  if (count == 0) {
+    return 0;
+  }
+  std::uint64_t rank = static_cast<std::uint64_t>(percentile / 100.0 * count);
+  std::uint64_t seen = 0;
+  for (int i = 0; i < kNumberOfBuckets; i++) {
+    seen += buckets[i];
+    if (seen > rank) {
+      // Report the bucket's upper bound, but never more than the maximum.
+      std::uint64_t upper = i < 63 ? (std::uint64_t(1) << (i + 1)) - 1 : max_ns;
+      return upper < max_ns ? upper : max_ns;
+    }
+  }
+  return max_ns;
+}
+
+HistogramSnapshot LatencyHistogram::Snapshot() const {
+  HistogramSnapshot snapshot;
+  for (int i = 0; i < HistogramSnapshot::kNumberOfBuckets; i++) {
+    snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+  snapshot.count = count_.load(std::memory_order_relaxed);
+  snapshot.sum_ns = sum_ns_.load(std::memory_order_relaxed);
+  snapshot.max_ns = max_ns_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+void LatencyHistogram::Reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_ns_.store(0, std::memory_order_relaxed);
+  max_ns_.store(0, std::memory_order_relaxed);
+}
+
+std::string ConsumerMetricsSnapshot::ToString() const {
+  return fmt::format(
+      "items {} ({:.1f}/s), queue depth {} (max {}), queue latency [{}], "
+      "process time [{}], lock wait [{}]",
+      items, items_per_second, queue_depth, max_queue_depth,
+      FormatHistogram(queue_latency), FormatHistogram(process_time),
+      FormatHistogram(lock_wait));
+}
+
+ConsumerMetricsSnapshot ConsumerMetrics::Snapshot() const {
+  ConsumerMetricsSnapshot snapshot;
+  snapshot.elapsed_s =
+      (Now() - start_time_.load(std::memory_order_relaxed)) / 1e9;
+  snapshot.items = items_.load(std::memory_order_relaxed);
+  snapshot.items_per_second =
+      snapshot.elapsed_s > 0 ? snapshot.items / snapshot.elapsed_s : 0;
+  snapshot.queue_depth = queue_depth_.load(std::memory_order_relaxed);
+  snapshot.max_queue_depth = max_queue_depth_.load(std::memory_order_relaxed);
+  snapshot.queue_latency = queue_latency_.Snapshot();
+  snapshot.process_time = process_time_.Snapshot();
+  snapshot.lock_wait = lock_wait_.Snapshot();
+  return snapshot;
+}
+
+void ConsumerMetrics::Reset() {
+  start_time_.store(Now(), std::memory_order_relaxed);
+  items_.store(0, std::memory_order_relaxed);
+  queue_depth_.store(0, std::memory_order_relaxed);
+  max_queue_depth_.store(0, std::memory_order_relaxed);
+  queue_latency_.Reset();
+  process_time_.Reset();
+  lock_wait_.Reset();
+}
+
+}  // namespace cpptoolkit
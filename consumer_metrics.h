@@ -0,0 +1,151 @@
+/*
+ * consumer_metrics.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * ConsumerMetrics collects latency and throughput of an AsyncConsumer.
+ *   Every AsyncConsumer owns one. It records enqueue-to-dequeue latency,
+ *   processing time and lock wait time in LatencyHistograms, plus queue
+ *   depth and processed items. Recording only does relaxed atomic adds, so
+ *   it is cheap enough to leave on in production. Snapshot() copies the
+ *   counters, to be logged with ToString() or saved with save_data_to_h5().
+ *   The queue latency needs the enqueue time of every item. RingAsyncConsumer
+ *   stores it with the item. A subclass of AsyncConsumer with its own buffer
+ *   has to keep MetricsNow() per item and call RecordQueueLatency() when it
+ *   loads the item, as AsyncConsumerTest does. Otherwise it stays empty.
+ */
+
+#ifndef CPPTOOLKIT_CONSUMER_METRICS_H_
+#define CPPTOOLKIT_CONSUMER_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace cpptoolkit {
+
+struct HistogramSnapshot {
+  static constexpr int kNumberOfBuckets = 64;
+
+  std::uint64_t count = 0;
+  std::uint64_t sum_ns = 0;
+  std::uint64_t max_ns = 0;
+  // Bucket i counts durations in [2^i, 2^(i+1)) ns, bucket 0 also holds 0.
+  std::array<std::uint64_t, kNumberOfBuckets> buckets{};
+
+  double mean_ns() const {
+    return count > 0 ? static_cast<double>(sum_ns) / count : 0.0;
+  }
+  // Upper bound of the bucket holding the given percentile (0 to 100).
+  std::uint64_t percentile_ns(double percentile) const;
+};
+
+// Lock-free histogram of durations with power-of-two buckets.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() { Reset(); }
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void Record(std::int64_t nanoseconds) {
+    std::uint64_t value =
+        nanoseconds > 0 ? static_cast<std::uint64_t>(nanoseconds) : 0;
+    buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_ns_.fetch_add(value, std::memory_order_relaxed);
+    std::uint64_t max = max_ns_.load(std::memory_order_relaxed);
+    while (value > max && !max_ns_.compare_exchange_weak(
+                              max, value, std::memory_order_relaxed)) {
+    }
+  }
+  HistogramSnapshot Snapshot() const;
+  void Reset();
+
+ private:
+  static int BucketIndex(std::uint64_t value) {
+    int index = 0;
+    for (int shift = 32; shift > 0; shift >>= 1) {
+      if (value >> shift) {
+        value >>= shift;
+        index += shift;
+      }
+    }
+    return index;
+  }
+
+  std::array<std::atomic<std::uint64_t>, HistogramSnapshot::kNumberOfBuckets>
+      buckets_;
+  std::atomic<std::uint64_t> count_;
+  std::atomic<std::uint64_t> sum_ns_;
+  std::atomic<std::uint64_t> max_ns_;
+};
+
+struct ConsumerMetricsSnapshot {
+  double elapsed_s = 0;  // since construction or the last Reset()
+  std::uint64_t items = 0;
+  double items_per_second = 0;
+  std::uint64_t queue_depth = 0;      // at the last sample
+  std::uint64_t max_queue_depth = 0;  // since the last Reset()
+  HistogramSnapshot queue_latency;    // enqueue to dequeue
+  HistogramSnapshot process_time;     // ProcessData()/ProcessBatch()
+  HistogramSnapshot lock_wait;        // acquiring lock_data_transfer_
+
+  std::string ToString() const;
+};
+
+class ConsumerMetrics {
+ public:
+  ConsumerMetrics() { Reset(); }
+  ConsumerMetrics(const ConsumerMetrics&) = delete;
+  ConsumerMetrics& operator=(const ConsumerMetrics&) = delete;
+
+  // Steady clock in nanoseconds, used for all timestamps.
+  static std::int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  bool enabled() const { return flag_enabled_.load(std::memory_order_relaxed); }
+  void set_enabled(bool flag_enabled) { flag_enabled_ = flag_enabled; }
+
+  void RecordQueueLatency(std::int64_t enqueue_time) {
+    queue_latency_.Record(Now() - enqueue_time);
+  }
+  void RecordProcessTime(std::int64_t nanoseconds, std::uint64_t items) {
+    process_time_.Record(nanoseconds);
+    items_.fetch_add(items, std::memory_order_relaxed);
+  }
+  void RecordLockWait(std::int64_t nanoseconds) {
+    lock_wait_.Record(nanoseconds);
+  }
+  void RecordQueueDepth(std::size_t depth) {
+    queue_depth_.store(depth, std::memory_order_relaxed);
+    std::uint64_t max = max_queue_depth_.load(std::memory_order_relaxed);
+    while (depth > max && !max_queue_depth_.compare_exchange_weak(
+                              max, depth, std::memory_order_relaxed)) {
+    }
+  }
+
+  ConsumerMetricsSnapshot Snapshot() const;
+  void Reset();
+
+ private:
+  std::atomic<bool> flag_enabled_{true};
+  std::atomic<std::int64_t> start_time_{0};
+  std::atomic<std::uint64_t> items_{0};
+  std::atomic<std::uint64_t> queue_depth_{0};
+  std::atomic<std::uint64_t> max_queue_depth_{0};
+  LatencyHistogram queue_latency_;
+  LatencyHistogram process_time_;
+  LatencyHistogram lock_wait_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_CONSUMER_METRICS_H_
@@ -17,6 +17,7 @@
 
 #include <sys/timeb.h>
 #include <stdint.h>
+#include <cstdio>
 #include <chrono>
 #include <string>
 #include <fstream>
@@ -103,7 +104,10 @@ public:
 
   static std::string get_formated_time(int64_t timestamp) {
     char time_str[32] = { 0 };
-    sprintf_s(time_str, "%02lld:%02lld:%02lld", (timestamp / kHour), (timestamp / kMinute % 60), (timestamp / kSecond % 60));
+    snprintf(time_str, sizeof(time_str), "%02lld:%02lld:%02lld",
+             static_cast<long long>(timestamp / kHour),
+             static_cast<long long>(timestamp / kMinute % 60),
+             static_cast<long long>(timestamp / kSecond % 60));
     return time_str;
   }
 
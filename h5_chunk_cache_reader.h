@@ -0,0 +1,358 @@
+/*
+ * h5_chunk_cache_reader.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * H5ChunkCacheReader plays back a chunked dataset frame by frame.
+ *   Frame i is dataset[i]. The reader works on chunk rows: the
+ *   frames_per_chunk() frames that share the first chunk coordinate, read
+ *   with one selection so every chunk is decompressed once. Recently used
+ *   rows are kept in an LRU of max_cached_rows decompressed rows.
+ *   The raw-data chunk cache of HDF5 is configured for the dataset too,
+ *   the default 1 MB thrashes as soon as a row of chunks is larger.
+ *   Once two consecutive rows are requested, the next prefetch_rows rows
+ *   are loaded on a background thread, so sequential playback hits the
+ *   LRU. Random access never triggers prefetching.
+ *   stats() reports hits, misses, prefetches and evictions to size the
+ *   cache. The reader keeps a read-only SafeHighFiveFile open but only
+ *   locks it while it loads a row (H5LockScope::kScoped), so it does not
+ *   block other files between reads.
+ *
+ * Usage example:
+ *
+ *     H5ChunkCacheOptions options;
+ *     options.prefetch_rows = 4;
+ *     H5ChunkCacheReader<uint16_t> reader("record.h5", "/frames", options);
+ *     for (size_t i = 0; i < reader.number_of_frames(); i++) {
+ *       xt::xarray<uint16_t> frame = reader.ReadFrame(i);
+ *     }
+ *     LOG_INFO("hit rate {}", reader.stats().hit_rate());
+ */
+
+#ifndef CPPTOOLKIT_H5_CHUNK_CACHE_READER_H_
+#define CPPTOOLKIT_H5_CHUNK_CACHE_READER_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <CppToolkit/handle_exception.h>
+#include <CppToolkit/hdf5_toolkit_core.h>
+#include <CppToolkit/log.h>
+
+namespace cpptoolkit {
+
+struct H5ChunkCacheOptions {
+  // HDF5 raw-data chunk cache of the dataset, see H5Pset_chunk_cache.
+  // cache_bytes == 0 sizes it to hold prefetch_rows + 1 chunk rows.
+  size_t hdf5_cache_bytes = 0;
+  size_t hdf5_cache_slots = 12421;  // prime, about 100 times the chunks
+  double hdf5_preemption = 0.75;
+  // Decompressed chunk rows kept by the reader.
+  size_t max_cached_rows = 16;
+  // Rows loaded ahead once access is sequential, 0 disables prefetching.
+  size_t prefetch_rows = 2;
+};
+
+struct H5ChunkCacheStats {
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  std::uint64_t prefetches = 0;      // rows loaded by the prefetch thread
+  std::uint64_t prefetch_hits = 0;   // hits on rows loaded ahead
+  std::uint64_t evictions = 0;
+  double hit_rate() const {
+    std::uint64_t total = hits + misses;
+    return total > 0 ? static_cast<double>(hits) / total : 0.0;
+  }
+};
+
+template <typename T>
+class H5ChunkCacheReader {
+ public:
+  using Row = std::shared_ptr<const xt::xarray<T>>;
+
+  H5ChunkCacheReader(const std::string& filename,
+                     const std::string& dataset_name,
+                     const H5ChunkCacheOptions& options = H5ChunkCacheOptions())
+      : kOptions_(options),
+        file_(filename, HighFive::File::ReadOnly, H5LockScope::kScoped),
+        dataset_(OpenDataSet(dataset_name)) {
+    if (kOptions_.prefetch_rows > 0) {
+      th_prefetch_ = std::thread(&H5ChunkCacheReader::PrefetchLoop, this);
+    }
+  }
+  ~H5ChunkCacheReader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      flag_stop_ = true;
+    }
+    cond_var_prefetch_.notify_all();
+    if (th_prefetch_.joinable()) {
+      th_prefetch_.join();
+    }
+    // dataset_ is released under the lock, then the file closes.
+    lock_close_ = file_.Lock();
+  }
+  H5ChunkCacheReader(const H5ChunkCacheReader&) = delete;
+  H5ChunkCacheReader& operator=(const H5ChunkCacheReader&) = delete;
+
+  size_t number_of_frames() const { return shape_[0]; }
+  std::vector<size_t> frame_shape() const {
+    return std::vector<size_t>(shape_.begin() + 1, shape_.end());
+  }
+  size_t frames_per_chunk() const { return frames_per_chunk_; }
+  size_t number_of_rows() const {
+    return (shape_[0] + frames_per_chunk_ - 1) / frames_per_chunk_;
+  }
+
+  // Copy of frame index.
+  xt::xarray<T> ReadFrame(size_t index) {
+    if (index >= shape_[0]) {
+      CPPTOOLKIT_THROW_EXCEPTION(std::out_of_range("Frame index out of range."),
+                                 ErrorLevel::E_ERROR);
+    }
+    Row row = ReadRow(index / frames_per_chunk_);
+    const T* begin =
+        row->data() + (index % frames_per_chunk_) * frame_size_;
+    xt::xarray<T> frame(frame_shape());
+    std::copy(begin, begin + frame_size_, frame.data());
+    return frame;
+  }
+
+  // Chunk row row_index, frames_per_chunk() frames or fewer for the last
+  // row. The row stays valid after it is evicted.
+  Row ReadRow(size_t row_index) {
+    if (row_index >= number_of_rows()) {
+      CPPTOOLKIT_THROW_EXCEPTION(std::out_of_range("Row index out of range."),
+                                 ErrorLevel::E_ERROR);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    SchedulePrefetch(row_index);
+    while (true) {
+      auto iter = cache_.find(row_index);
+      if (iter != cache_.end()) {
+        stats_.hits++;
+        if (iter->second.flag_prefetched) {
+          stats_.prefetch_hits++;
+          iter->second.flag_prefetched = false;
+        }
+        lru_.splice(lru_.begin(), lru_, iter->second.position);
+        return iter->second.row;
+      }
+      if (loading_.count(row_index) == 0) {
+        break;
+      }
+      // Queued but not started, read it here rather than wait for the
+      // rows queued before it.
+      auto queued = std::find(queue_prefetch_.begin(), queue_prefetch_.end(),
+                              row_index);
+      if (queued != queue_prefetch_.end()) {
+        queue_prefetch_.erase(queued);
+        break;
+      }
+      // Being prefetched, wait for it rather than reading it twice.
+      cond_var_loaded_.wait(lock);
+    }
+    stats_.misses++;
+    loading_.insert(row_index);
+    lock.unlock();
+    Row row;
+    try {
+      row = LoadRow(row_index);
+    } catch (...) {
+      lock.lock();
+      loading_.erase(row_index);
+      cond_var_loaded_.notify_all();
+      throw;
+    }
+    lock.lock();
+    Insert(row_index, row, false);
+    return row;
+  }
+
+  H5ChunkCacheStats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+  void ResetStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_ = H5ChunkCacheStats();
+  }
+
+ private:
+  struct Entry {
+    Row row;
+    std::list<size_t>::iterator position;
+    bool flag_prefetched = false;
+  };
+
+  // Reads the layout into shape_, frames_per_chunk_ and frame_size_, then
+  // opens the dataset with its chunk cache configured.
+  HighFive::DataSet OpenDataSet(const std::string& dataset_name) {
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    HighFive::DataSet probe = file_.get().getDataSet(dataset_name);
+    shape_ = probe.getDimensions();
+    if (shape_.empty()) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("H5ChunkCacheReader needs a dataset of rank "
+                                "1 or more."),
+          ErrorLevel::E_ERROR);
+    }
+    HighFive::DataSetCreateProps create_props = probe.getCreatePropertyList();
+    frames_per_chunk_ = 1;
+    if (H5Pget_layout(create_props.getId()) == H5D_CHUNKED) {
+      std::vector<hsize_t> chunk(shape_.size());
+      if (H5Pget_chunk(create_props.getId(), static_cast<int>(chunk.size()),
+                       chunk.data()) != static_cast<int>(chunk.size())) {
+        CPPTOOLKIT_THROW_EXCEPTION(
+            std::runtime_error("Failed to get the chunk shape of " +
+                               dataset_name + "."),
+            ErrorLevel::E_ERROR);
+      }
+      frames_per_chunk_ = std::max<size_t>(chunk[0], 1);
+    }
+    frame_size_ = 1;
+    for (size_t i = 1; i < shape_.size(); i++) {
+      frame_size_ *= shape_[i];
+    }
+    // Reopen with a chunk cache that holds every row in flight.
+    size_t cache_bytes = kOptions_.hdf5_cache_bytes;
+    if (cache_bytes == 0) {
+      cache_bytes = (kOptions_.prefetch_rows + 1) * frames_per_chunk_ *
+                    frame_size_ * sizeof(T);
+    }
+    HighFive::DataSetAccessProps access_props;
+    access_props.add(HighFive::Caching(kOptions_.hdf5_cache_slots, cache_bytes,
+                                       kOptions_.hdf5_preemption));
+    return file_.get().getDataSet(dataset_name, access_props);
+  }
+
+  // Read a whole row with one selection. Only this reader uses the file
+  // handle, io_mutex_ keeps the prefetch thread and the caller apart, the
+  // file lock other HDF5 users.
+  Row LoadRow(size_t row_index) {
+    size_t begin = row_index * frames_per_chunk_;
+    size_t frames = std::min(frames_per_chunk_, shape_[0] - begin);
+    std::vector<size_t> offset(shape_.size(), 0);
+    std::vector<size_t> count = shape_;
+    offset[0] = begin;
+    count[0] = frames;
+    auto row = std::make_shared<xt::xarray<T>>(count);
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    SafeHighFiveFile::ScopedLock file_lock = file_.Lock();
+    dataset_.select(offset, count).read_raw(row->data());
+    return row;
+  }
+
+  // Call with mutex_ held.
+  void Insert(size_t row_index, Row row, bool flag_prefetched) {
+    loading_.erase(row_index);
+    cond_var_loaded_.notify_all();
+    if (cache_.count(row_index) > 0 || kOptions_.max_cached_rows == 0) {
+      return;
+    }
+    while (cache_.size() >= kOptions_.max_cached_rows) {
+      cache_.erase(lru_.back());
+      lru_.pop_back();
+      stats_.evictions++;
+    }
+    lru_.push_front(row_index);
+    cache_[row_index] = Entry{std::move(row), lru_.begin(), flag_prefetched};
+  }
+
+  // Call with mutex_ held. Queues the rows after row_index once the
+  // previous request was the row before it.
+  void SchedulePrefetch(size_t row_index) {
+    bool flag_sequential = last_row_ != kNoRow && row_index == last_row_ + 1;
+    if (row_index != last_row_) {
+      last_row_ = row_index;
+    }
+    if (!flag_sequential || kOptions_.prefetch_rows == 0) {
+      return;
+    }
+    size_t end = std::min(row_index + 1 + kOptions_.prefetch_rows,
+                          number_of_rows());
+    bool flag_queued = false;
+    for (size_t next = row_index + 1; next < end; next++) {
+      if (cache_.count(next) == 0 && loading_.count(next) == 0) {
+        loading_.insert(next);
+        queue_prefetch_.push_back(next);
+        flag_queued = true;
+      }
+    }
+    if (flag_queued) {
+      cond_var_prefetch_.notify_one();
+    }
+  }
+
+  void PrefetchLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_var_prefetch_.wait(
+          lock, [this] { return flag_stop_ || !queue_prefetch_.empty(); });
+      if (flag_stop_) {
+        return;
+      }
+      size_t row_index = queue_prefetch_.front();
+      queue_prefetch_.pop_front();
+      lock.unlock();
+      Row row;
+      try {
+        row = LoadRow(row_index);
+      } catch (...) {
+        // The caller reads the row itself and sees the error then.
+        LOG_WARN("[H5ChunkCacheReader]Failed to prefetch row {}: {}",
+                 row_index, boost::current_exception_diagnostic_information());
+      }
+      lock.lock();
+      if (row) {
+        stats_.prefetches++;
+        Insert(row_index, std::move(row), true);
+      } else {
+        loading_.erase(row_index);
+        cond_var_loaded_.notify_all();
+      }
+    }
+  }
+
+  const H5ChunkCacheOptions kOptions_;
+  SafeHighFiveFile file_;
+  // Taken by the destructor, so dataset_ is released under the lock.
+  SafeHighFiveFile::ScopedLock lock_close_;
+  // Set by OpenDataSet(), so declared before dataset_.
+  std::vector<size_t> shape_;
+  size_t frames_per_chunk_ = 1;
+  size_t frame_size_ = 1;
+  HighFive::DataSet dataset_;
+
+  // Guards the LRU, the prefetch queue and the stats.
+  mutable std::mutex mutex_;
+  std::mutex io_mutex_;
+  std::condition_variable cond_var_loaded_;
+  std::condition_variable cond_var_prefetch_;
+  std::unordered_map<size_t, Entry> cache_;
+  std::list<size_t> lru_;  // most recently used first
+  std::unordered_set<size_t> loading_;
+  std::deque<size_t> queue_prefetch_;
+  static constexpr size_t kNoRow = static_cast<size_t>(-1);
+  size_t last_row_ = kNoRow;
+  H5ChunkCacheStats stats_;
+  bool flag_stop_ = false;
+  std::thread th_prefetch_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_H5_CHUNK_CACHE_READER_H_
@@ -0,0 +1,104 @@
+#include "h5_dataset_view.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace cpptoolkit {
+
+namespace {
+std::uint64_t GetMappingGranularity() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwAllocationGranularity;
+#else
+  return static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+}  // namespace
+
+MappedFileRegion::MappedFileRegion(const std::string& filename,
+                                   std::uint64_t offset, std::size_t length) {
+  if (length == 0) {
+    return;
+  }
+  static const std::uint64_t kGranularity = GetMappingGranularity();
+  std::uint64_t aligned_offset = offset / kGranularity * kGranularity;
+  std::size_t mapping_size =
+      static_cast<std::size_t>(offset - aligned_offset) + length;
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Failed to open " + filename + " for mapping.");
+  }
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);  // the mapping keeps the file open
+  if (mapping == nullptr) {
+    throw std::runtime_error("Failed to create a mapping of " + filename +
+                             ".");
+  }
+  void* ptr = MapViewOfFile(mapping, FILE_MAP_READ,
+                            static_cast<DWORD>(aligned_offset >> 32),
+                            static_cast<DWORD>(aligned_offset & 0xffffffff),
+                            mapping_size);
+  CloseHandle(mapping);  // the view keeps the mapping alive
+  if (ptr == nullptr) {
+    throw std::runtime_error("Failed to map " + filename + ".");
+  }
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open " + filename + " for mapping.");
+  }
+  void* ptr = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd,
+                   static_cast<off_t>(aligned_offset));
+  close(fd);  // the mapping keeps the file open
+  if (ptr == MAP_FAILED) {
+    throw std::runtime_error("Failed to map " + filename + ".");
+  }
+#endif
+  mapping_ = ptr;
+  mapping_size_ = mapping_size;
+  data_ = static_cast<const char*>(ptr) + (offset - aligned_offset);
+  size_ = length;
+}
+
+MappedFileRegion& MappedFileRegion::operator=(
+    MappedFileRegion&& other) noexcept {
+  if (this != &other) {
+    Unmap();
+    mapping_ = other.mapping_;
+    mapping_size_ = other.mapping_size_;
+    data_ = other.data_;
+    size_ = other.size_;
+    other.mapping_ = nullptr;
+    other.mapping_size_ = 0;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+void MappedFileRegion::Unmap() {
+  if (mapping_ == nullptr) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(mapping_);
+#else
+  munmap(mapping_, mapping_size_);
+#endif
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  data_ = nullptr;
+  size_ = 0;
+}
+
+}  // namespace cpptoolkit
@@ -0,0 +1,216 @@
+/*
+ * h5_dataset_view.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * H5DatasetView opens an HDF5 dataset for reading without loading it.
+ *   A contiguous dataset whose storage is allocated and whose file type is
+ *   the native type of T is memory-mapped read-only at the offset reported
+ *   by H5Dget_offset. mapped() then adapts the mapping as an xtensor
+ *   expression without copying, and the OS only pages in what is touched.
+ *   Other datasets, e.g. chunked or compressed ones, fall back to reading
+ *   the requested part on demand, so only the chunks it touches are read
+ *   and decompressed. Read() and ReadSlice() work in both cases.
+ *   The view keeps the file open through a SafeHighFiveFile, but only
+ *   locks it while it calls HDF5 (H5LockScope::kScoped), so a view does
+ *   not block other files for its lifetime. Do not write to the dataset
+ *   while a view of it exists.
+ *
+ * Usage example:
+ *
+ *     H5DatasetView<uint16_t> volume("record.h5", "/volume");
+ *     xt::xarray<uint16_t> frame = volume.ReadSlice(42);
+ *     if (volume.is_mapped()) {
+ *       auto all = volume.mapped();  // zero-copy
+ *       double mean = xt::mean(xt::view(all, 42))();
+ *     }
+ */
+
+#ifndef CPPTOOLKIT_H5_DATASET_VIEW_H_
+#define CPPTOOLKIT_H5_DATASET_VIEW_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <CppToolkit/handle_exception.h>
+#include <CppToolkit/hdf5_toolkit_core.h>
+#include <xtensor/views/xstrided_view.hpp>
+
+namespace cpptoolkit {
+
+// Read-only memory mapping of part of a file, see h5_dataset_view.cpp.
+class MappedFileRegion {
+ public:
+  MappedFileRegion() = default;
+  // Throws std::runtime_error if the file cannot be mapped.
+  MappedFileRegion(const std::string& filename, std::uint64_t offset,
+                   std::size_t length);
+  ~MappedFileRegion() { Unmap(); }
+  MappedFileRegion(const MappedFileRegion&) = delete;
+  MappedFileRegion& operator=(const MappedFileRegion&) = delete;
+  MappedFileRegion(MappedFileRegion&& other) noexcept {
+    *this = std::move(other);
+  }
+  MappedFileRegion& operator=(MappedFileRegion&& other) noexcept;
+
+  const void* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool is_mapped() const { return data_ != nullptr; }
+
+ private:
+  void Unmap();
+
+  // The mapping starts at an offset aligned to the page or allocation
+  // granularity, data_ points into it.
+  void* mapping_ = nullptr;
+  std::size_t mapping_size_ = 0;
+  const void* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+template <typename T>
+class H5DatasetView {
+ public:
+  H5DatasetView(const std::string& filename, const std::string& dataset_name)
+      : file_(filename, HighFive::File::ReadOnly, H5LockScope::kScoped),
+        dataset_(OpenDataSet(dataset_name)) {
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    size_ = 1;
+    for (auto dim : shape_) {
+      size_ *= dim;
+    }
+    if (size_ > 0 && is_mappable()) {
+      haddr_t offset = H5Dget_offset(dataset_.getId());
+      try {
+        region_ = MappedFileRegion(filename, offset, size_ * sizeof(T));
+      } catch (const std::exception& e) {
+        LOG_WARN("[H5DatasetView]Reading {} on demand, mapping failed: {}",
+                 dataset_name, e.what());
+      }
+    }
+  }
+  // The dataset is released under the lock, then the file closes.
+  ~H5DatasetView() { lock_close_ = file_.Lock(); }
+  H5DatasetView(const H5DatasetView&) = delete;
+  H5DatasetView& operator=(const H5DatasetView&) = delete;
+
+  const std::vector<size_t>& shape() const { return shape_; }
+  size_t size() const { return size_; }
+  bool is_mapped() const { return region_.is_mapped(); }
+
+  // Zero-copy xtensor adaptor of the whole dataset, only valid while the
+  // view lives and only if is_mapped().
+  auto mapped() const {
+    if (!is_mapped()) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::logic_error("Dataset is not memory-mapped."),
+          ErrorLevel::E_ERROR);
+    }
+    return xt::adapt(static_cast<const T*>(region_.data()), size_,
+                     xt::no_ownership(), shape_);
+  }
+
+  // Copy of the block starting at offset with count elements per
+  // dimension.
+  xt::xarray<T> Read(const std::vector<size_t>& offset,
+                     const std::vector<size_t>& count) const {
+    if (offset.size() != shape_.size() || count.size() != shape_.size()) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Selection rank does not match the dataset."),
+          ErrorLevel::E_ERROR);
+    }
+    for (size_t i = 0; i < shape_.size(); i++) {
+      if (offset[i] + count[i] > shape_[i]) {
+        CPPTOOLKIT_THROW_EXCEPTION(
+            std::out_of_range("Selection exceeds the dataset."),
+            ErrorLevel::E_ERROR);
+      }
+    }
+    xt::xarray<T> result(count);
+    if (result.size() == 0) {
+      return result;
+    }
+    if (is_mapped()) {
+      xt::xstrided_slice_vector slices;
+      for (size_t i = 0; i < shape_.size(); i++) {
+        slices.push_back(xt::range(offset[i], offset[i] + count[i]));
+      }
+      auto all = mapped();
+      result = xt::strided_view(all, slices);
+    } else {
+      SafeHighFiveFile::ScopedLock lock = file_.Lock();
+      dataset_.select(offset, count).read_raw(result.data());
+    }
+    return result;
+  }
+  // Strided or blocked selection, and several of them in one call, see
+  // ReadHyperslab() and ReadHyperslabs(). Always read through HDF5.
+  xt::xarray<T> Read(const H5Hyperslab& slab) const {
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    return ReadHyperslab<T>(dataset_, slab);
+  }
+  std::vector<xt::xarray<T>> Read(
+      const std::vector<H5Hyperslab>& slabs) const {
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    return ReadHyperslabs<T>(dataset_, slabs);
+  }
+  // Entry index along the first axis, e.g. one frame of a stack.
+  xt::xarray<T> ReadSlice(size_t index) const {
+    std::vector<size_t> offset(shape_.size(), 0);
+    std::vector<size_t> count = shape_;
+    if (!shape_.empty()) {
+      offset[0] = index;
+      count[0] = 1;
+    }
+    xt::xarray<T> result = Read(offset, count);
+    if (!shape_.empty()) {
+      result.reshape(std::vector<size_t>(shape_.begin() + 1, shape_.end()));
+    }
+    return result;
+  }
+
+ private:
+  // Opens the dataset and reads its shape under the file lock.
+  HighFive::DataSet OpenDataSet(const std::string& dataset_name) {
+    SafeHighFiveFile::ScopedLock lock = file_.Lock();
+    HighFive::DataSet dataset = file_.get().getDataSet(dataset_name);
+    shape_ = dataset.getDimensions();
+    return dataset;
+  }
+  // Only a contiguous dataset in the native layout of T can be used as is.
+  // Call with the file locked.
+  bool is_mappable() const {
+    HighFive::DataSetCreateProps props = dataset_.getCreatePropertyList();
+    if (H5Pget_layout(props.getId()) != H5D_CONTIGUOUS ||
+        H5Pget_nfilters(props.getId()) > 0) {
+      return false;
+    }
+    if (H5Dget_offset(dataset_.getId()) == HADDR_UNDEF) {
+      return false;  // storage not allocated yet
+    }
+    // Only the default driver stores the dataset at that offset of the file.
+    hid_t access_props = H5Fget_access_plist(file_.get().getId());
+    bool flag_sec2 = H5Pget_driver(access_props) == H5FD_SEC2;
+    H5Pclose(access_props);
+    return flag_sec2 &&
+           dataset_.getDataType() == HighFive::create_datatype<T>();
+  }
+
+  SafeHighFiveFile file_;
+  // Taken by the destructor, so dataset_ is released under the lock.
+  SafeHighFiveFile::ScopedLock lock_close_;
+  // Set by OpenDataSet(), so declared before dataset_.
+  std::vector<size_t> shape_;
+  HighFive::DataSet dataset_;
+  size_t size_ = 0;
+  MappedFileRegion region_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_H5_DATASET_VIEW_H_
@@ -0,0 +1,206 @@
+/*
+ * h5_stream_writer.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * H5StreamWriter appends frames to a growing HDF5 dataset.
+ *   The dataset has an unlimited first dimension and is chunked, frame i
+ *   is dataset[i]. Append() writes one frame or a block of frames right
+ *   away, but the dataset is extended frames_per_extend frames at a time,
+ *   so the metadata is not rewritten for every frame. Close() shrinks the
+ *   dataset to the frames actually written and flushes the file. The
+ *   destructor closes the writer too, so a writer unwound by an exception
+ *   still leaves a valid dataset holding every frame appended so far.
+ *   H5StreamSink is a PipelineSink that appends every xarray it receives,
+ *   so recording can be the last stage of a Pipeline or a stand-alone
+ *   AsyncConsumer fed with ProcessDataAsync().
+ *
+ * Usage example:
+ *
+ *     SafeHighFiveFile file("record.h5", HighFive::File::Overwrite);
+ *     H5StreamWriter<uint16_t> writer(file, "/frames",
+ *                                     {height, width},
+ *                                     H5WriteOptions::Compressed(1));
+ *     while (acquiring) {
+ *       writer.Append(frame.data(), 1);
+ *     }
+ *     writer.Close();
+ */
+
+#ifndef CPPTOOLKIT_H5_STREAM_WRITER_H_
+#define CPPTOOLKIT_H5_STREAM_WRITER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <CppToolkit/async_pipeline.h>
+#include <CppToolkit/handle_exception.h>
+#include <CppToolkit/hdf5_toolkit_core.h>
+#include <CppToolkit/log.h>
+
+namespace cpptoolkit {
+
+template <typename T>
+class H5StreamWriter {
+ public:
+  // frame_shape is the shape of one frame. options.flag_chunked is implied,
+  // an empty options.chunk_shape is guessed for frames_per_extend frames.
+  // Writes through file, which must outlive the writer, so its lock covers
+  // every write.
+  H5StreamWriter(SafeHighFiveFile& file, const std::string& path,
+                 const std::vector<size_t>& frame_shape,
+                 H5WriteOptions options = H5WriteOptions(),
+                 size_t frames_per_extend = 64)
+      : file_(file),
+        kFrameShape_(frame_shape),
+        kFramesPerExtend_(std::max<size_t>(frames_per_extend, 1)),
+        dataset_(CreateDataSet(path, options)) {
+    flag_open_ = true;
+  }
+  ~H5StreamWriter() {
+    try {
+      Close();
+    } catch (...) {
+      LOG_ERROR("[H5StreamWriter]Failed to close dataset: {}",
+                boost::current_exception_diagnostic_information());
+    }
+  }
+  H5StreamWriter(const H5StreamWriter&) = delete;
+  H5StreamWriter& operator=(const H5StreamWriter&) = delete;
+
+  // data holds number_of_frames frames, one after another.
+  void Append(const T* data, size_t number_of_frames) {
+    if (!flag_open_) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::logic_error("H5StreamWriter is closed."), ErrorLevel::E_ERROR);
+    }
+    if (number_of_frames == 0) {
+      return;
+    }
+    size_t begin = number_of_frames_.load(std::memory_order_relaxed);
+    size_t end = begin + number_of_frames;
+    if (end > capacity_) {
+      // Grow a whole batch of frames at a time.
+      capacity_ = (end + kFramesPerExtend_ - 1) / kFramesPerExtend_ *
+                  kFramesPerExtend_;
+      dataset_.resize(DatasetShape(capacity_));
+    }
+    std::vector<size_t> offset(kFrameShape_.size() + 1, 0);
+    offset[0] = begin;
+    dataset_.select(offset, DatasetShape(number_of_frames)).write_raw(data);
+    number_of_frames_.store(end, std::memory_order_release);
+  }
+  // block is one frame of frame_shape, or frames stacked along a new first
+  // axis.
+  void Append(const xt::xarray<T>& block) {
+    std::vector<size_t> shape(block.shape().begin(), block.shape().end());
+    if (shape == kFrameShape_) {
+      Append(block.data(), 1);
+    } else if (shape.size() == kFrameShape_.size() + 1 &&
+               std::equal(kFrameShape_.begin(), kFrameShape_.end(),
+                          shape.begin() + 1)) {
+      Append(block.data(), shape[0]);
+    } else {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Block shape does not match the frame shape."),
+          ErrorLevel::E_ERROR);
+    }
+  }
+
+  // Shrink the dataset to the frames written and flush the file. Appending
+  // afterwards throws.
+  void Close() {
+    if (!flag_open_) {
+      return;
+    }
+    flag_open_ = false;
+    size_t number_of_frames = number_of_frames_.load(std::memory_order_relaxed);
+    if (capacity_ != number_of_frames) {
+      dataset_.resize(DatasetShape(number_of_frames));
+      capacity_ = number_of_frames;
+    }
+    file_.get().flush();
+  }
+
+  bool is_open() const { return flag_open_; }
+  // Safe to call from any thread while another one appends.
+  size_t number_of_frames() const {
+    return number_of_frames_.load(std::memory_order_acquire);
+  }
+  const std::vector<size_t>& frame_shape() const { return kFrameShape_; }
+
+ private:
+  std::vector<size_t> DatasetShape(size_t number_of_frames) const {
+    std::vector<size_t> shape;
+    shape.reserve(kFrameShape_.size() + 1);
+    shape.push_back(number_of_frames);
+    shape.insert(shape.end(), kFrameShape_.begin(), kFrameShape_.end());
+    return shape;
+  }
+
+  HighFive::DataSet CreateDataSet(const std::string& path,
+                                  H5WriteOptions options) {
+    HighFive::File& file = file_.get();
+    if (options.flag_overwrite && file.exist(path)) {
+      file.unlink(path);
+    }
+    // An unlimited dimension needs chunking.
+    options.flag_chunked = true;
+    std::vector<size_t> max_shape =
+        DatasetShape(HighFive::DataSpace::UNLIMITED);
+    return file.createDataSet<T>(
+        path, HighFive::DataSpace(DatasetShape(0), max_shape),
+        MakeDataSetCreateProps<T>(DatasetShape(kFramesPerExtend_), options,
+                                  max_shape));
+  }
+
+  SafeHighFiveFile& file_;
+  const std::vector<size_t> kFrameShape_;
+  const size_t kFramesPerExtend_;
+  HighFive::DataSet dataset_;
+  std::atomic<size_t> number_of_frames_{0};
+  size_t capacity_ = 0;  // frames the dataset can hold before it grows
+  bool flag_open_ = false;
+};
+
+// Pipeline sink, or stand-alone AsyncConsumer, that records every frame it
+// receives with an H5StreamWriter on its consumer thread.
+template <typename T>
+class H5StreamSink : public PipelineSink<xt::xarray<T>> {
+ public:
+  // file must outlive the sink.
+  H5StreamSink(SafeHighFiveFile& file, const std::string& path,
+               const std::vector<size_t>& frame_shape,
+               H5WriteOptions options = H5WriteOptions(),
+               size_t frames_per_extend = 64, size_t capacity = 1024)
+      : PipelineSink<xt::xarray<T>>(capacity),
+        writer_(file, path, frame_shape, options, frames_per_extend) {}
+  // Stop the consumer before the writer is closed.
+  virtual ~H5StreamSink() { this->Close(); }
+
+  // Close the consumer, which writes everything still buffered, then the
+  // dataset.
+  void Finalize() {
+    this->Close();
+    writer_.Close();
+  }
+  size_t number_of_frames() const { return writer_.number_of_frames(); }
+
+ protected:
+  virtual void Consume(std::unique_ptr<xt::xarray<T>> data) {
+    writer_.Append(*data);
+  }
+
+ private:
+  H5StreamWriter<T> writer_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_H5_STREAM_WRITER_H_
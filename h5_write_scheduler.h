@@ -0,0 +1,396 @@
+/*
+ * h5_write_scheduler.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * H5WriteScheduler saves a batch of datasets to one file using every core.
+ *   Add() queues save jobs, Run() executes them in three phases:
+ *   1. The data of every job is converted to an xarray on the ThreadPool.
+ *   2. The datasets are created on the calling thread.
+ *   3. Chunked datasets are cut into chunks on the pool, each chunk is
+ *      shuffled and deflated there as the HDF5 filters would, and the
+ *      calling thread writes the finished chunks with H5Dwrite_chunk.
+ *   Only the calling thread calls HDF5, so no threadsafe build is needed,
+ *   and only the raw chunk writes are serialised. At most
+ *   max_chunks_in_flight compressed chunks are held in memory.
+ *   Contiguous datasets are written with one write_raw call each. Without
+ *   direct chunk writes (HDF5 before 1.10.3 or no zlib.h) chunked datasets
+ *   are written that way too, and HDF5 compresses them serially.
+ *   When zlib.h is found, the chunks are deflated with zlib itself, so
+ *   link with -lz as well as the HDF5 library.
+ *   Do not call Run() from a worker of the pool it uses.
+ *
+ * Usage example:
+ *
+ *     HighFive::File file("experiment.h5", HighFive::File::Overwrite);
+ *     H5WriteScheduler scheduler(file);
+ *     scheduler.Add("/", "volume", std::move(volume),
+ *                   H5WriteOptions::Compressed(1));
+ *     scheduler.Add("/", "timestamps", timestamps);  // std::vector<int64_t>
+ *     scheduler.Run();
+ */
+
+#ifndef CPPTOOLKIT_H5_WRITE_SCHEDULER_H_
+#define CPPTOOLKIT_H5_WRITE_SCHEDULER_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <CppToolkit/handle_exception.h>
+#include <CppToolkit/hdf5_toolkit_core.h>
+#include <CppToolkit/item_completion.h>
+#include <CppToolkit/thread_pool.h>
+
+#if H5_VERSION_GE(1, 10, 3) && defined(__has_include)
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define CPPTOOLKIT_H5_DIRECT_CHUNK_WRITE
+#endif
+#endif
+
+namespace cpptoolkit {
+
+class H5WriteScheduler {
+ public:
+  explicit H5WriteScheduler(HighFive::File& file,
+                            ThreadPool& pool = ThreadPool::GlobalInstance(),
+                            size_t max_chunks_in_flight = 0)
+      : file_(file),
+        pool_(pool),
+        kMaxChunksInFlight_(max_chunks_in_flight > 0 ? max_chunks_in_flight
+                                                     : 2 * pool.size() + 2) {}
+  H5WriteScheduler(const H5WriteScheduler&) = delete;
+  H5WriteScheduler& operator=(const H5WriteScheduler&) = delete;
+
+  // Queue data to be saved at group_name + dataset_name by Run().
+  template <typename __T>
+  void Add(std::string group_name, std::string dataset_name,
+           xt::xarray<__T> data,
+           const H5WriteOptions& options = H5WriteOptions()) {
+    auto job = std::make_unique<ArrayJob<__T>>();
+    job->path = group_name + dataset_name;
+    job->options = options;
+    job->array = std::move(data);
+    jobs_.push_back(std::move(job));
+  }
+  // Anything ConvertToXArray() accepts, converted on the pool.
+  template <typename Data>
+  void Add(std::string group_name, std::string dataset_name, Data data,
+           const H5WriteOptions& options = H5WriteOptions()) {
+    using Array = decltype(ConvertToXArray(data));
+    using Element = typename Array::value_type;
+    auto job = std::make_unique<ArrayJob<Element>>();
+    job->path = group_name + dataset_name;
+    job->options = options;
+    job->convert = [data = std::move(data)] { return ConvertToXArray(data); };
+    jobs_.push_back(std::move(job));
+  }
+
+  // Save every queued job, then clear the queue. Rethrows the first error,
+  // datasets already created are left in the file.
+  void Run() {
+    std::vector<std::unique_ptr<Job>> jobs = std::move(jobs_);
+    jobs_.clear();
+    ConvertAll(jobs);
+    std::vector<ChunkTask> chunk_tasks;
+    for (auto& job : jobs) {
+      if (job->options.flag_overwrite && file_.exist(job->path)) {
+        file_.unlink(job->path);
+      }
+      job->dataset = job->CreateDataSet(file_);
+      if (is_direct_write(*job)) {
+        size_t number_of_chunks = 1;
+        for (size_t i = 0; i < job->shape.size(); i++) {
+          number_of_chunks *= (job->shape[i] + job->chunk_shape[i] - 1) /
+                              job->chunk_shape[i];
+        }
+        for (size_t i = 0; i < number_of_chunks; i++) {
+          chunk_tasks.push_back(ChunkTask{job.get(), i});
+        }
+      } else if (job->number_of_elements() > 0) {
+        job->dataset->write_raw(job->data());
+      }
+    }
+    WriteChunks(chunk_tasks);
+  }
+
+  size_t number_of_jobs() const { return jobs_.size(); }
+
+  static bool is_direct_chunk_write_available() {
+#ifdef CPPTOOLKIT_H5_DIRECT_CHUNK_WRITE
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Cut chunk chunk_index, in row-major order of the chunk grid, out of the
+  // contiguous data, pad it to a full chunk and apply the filters of
+  // options. offset receives the first element of the chunk.
+  static std::vector<unsigned char> EncodeChunk(
+      const unsigned char* data, const std::vector<size_t>& shape,
+      const std::vector<size_t>& chunk_shape, size_t element_size,
+      size_t chunk_index, const H5WriteOptions& options,
+      std::vector<hsize_t>& offset) {
+    size_t rank = shape.size();
+    offset.assign(rank, 0);
+    std::vector<size_t> extent(rank);
+    for (size_t i = rank; i-- > 0;) {
+      size_t chunks = (shape[i] + chunk_shape[i] - 1) / chunk_shape[i];
+      offset[i] = (chunk_index % chunks) * chunk_shape[i];
+      chunk_index /= chunks;
+      extent[i] = std::min<size_t>(chunk_shape[i], shape[i] - offset[i]);
+    }
+    size_t chunk_elements = 1;
+    for (auto dim : chunk_shape) {
+      chunk_elements *= dim;
+    }
+    std::vector<unsigned char> chunk(chunk_elements * element_size, 0);
+    // Copy the rows along the last axis, counter walks the other axes.
+    std::vector<size_t> counter(rank, 0);
+    size_t row_bytes = extent[rank - 1] * element_size;
+    while (true) {
+      size_t source = 0, target = 0;
+      for (size_t i = 0; i < rank; i++) {
+        source = source * shape[i] + offset[i] + counter[i];
+        target = target * chunk_shape[i] + counter[i];
+      }
+      std::memcpy(chunk.data() + target * element_size,
+                  data + source * element_size, row_bytes);
+      size_t axis = rank - 1;
+      while (axis-- > 0 && ++counter[axis] == extent[axis]) {
+        counter[axis] = 0;
+      }
+      if (axis == static_cast<size_t>(-1)) {
+        break;
+      }
+    }
+    if (options.flag_shuffle && element_size > 1) {
+      // Byte j of every element goes to plane j, as H5Z_FILTER_SHUFFLE.
+      std::vector<unsigned char> shuffled(chunk.size());
+      for (size_t i = 0; i < chunk_elements; i++) {
+        for (size_t j = 0; j < element_size; j++) {
+          shuffled[j * chunk_elements + i] = chunk[i * element_size + j];
+        }
+      }
+      chunk.swap(shuffled);
+    }
+#ifdef CPPTOOLKIT_H5_DIRECT_CHUNK_WRITE
+    if (options.deflate_level > 0) {
+      uLongf compressed_size = compressBound(static_cast<uLong>(chunk.size()));
+      std::vector<unsigned char> compressed(compressed_size);
+      if (compress2(compressed.data(), &compressed_size, chunk.data(),
+                    static_cast<uLong>(chunk.size()),
+                    static_cast<int>(options.deflate_level)) != Z_OK) {
+        CPPTOOLKIT_THROW_EXCEPTION(
+            std::runtime_error("Failed to deflate a chunk."),
+            ErrorLevel::E_ERROR);
+      }
+      compressed.resize(compressed_size);
+      chunk.swap(compressed);
+    }
+#endif
+    return chunk;
+  }
+
+ private:
+  struct Job {
+    virtual ~Job() = default;
+    // Runs on the pool.
+    virtual void Convert() {}
+    virtual HighFive::DataSet CreateDataSet(HighFive::File& file) = 0;
+    virtual const void* data() const = 0;
+    size_t number_of_elements() const {
+      size_t result = 1;
+      for (auto dim : shape) {
+        result *= dim;
+      }
+      return result;
+    }
+
+    std::string path;
+    H5WriteOptions options;
+    std::vector<size_t> shape;
+    std::vector<size_t> chunk_shape;
+    size_t element_size = 0;
+    std::optional<HighFive::DataSet> dataset;
+  };
+  template <typename __T>
+  struct ArrayJob : Job {
+    void Convert() override {
+      if (convert) {
+        array = convert();
+        convert = nullptr;
+      }
+      this->shape.assign(array.shape().begin(), array.shape().end());
+      this->element_size = sizeof(__T);
+      // Scalars and empty datasets are written contiguous.
+      if (this->options.flag_chunked && !this->shape.empty() &&
+          this->number_of_elements() > 0) {
+        if (this->options.chunk_shape.empty()) {
+          this->chunk_shape = GuessChunkShape(this->shape, sizeof(__T));
+        } else {
+          CheckChunkShape(this->options.chunk_shape, this->shape);
+          this->chunk_shape = this->options.chunk_shape;
+        }
+      }
+    }
+    HighFive::DataSet CreateDataSet(HighFive::File& file) override {
+      H5WriteOptions options = this->options;
+      options.chunk_shape = this->chunk_shape;
+      return file.createDataSet<__T>(
+          this->path, HighFive::DataSpace(this->shape),
+          MakeDataSetCreateProps<__T>(this->shape, options));
+    }
+    const void* data() const override { return array.data(); }
+
+    xt::xarray<__T> array;
+    std::function<xt::xarray<__T>()> convert;
+  };
+
+  struct ChunkTask {
+    Job* job;
+    size_t chunk_index;
+  };
+  struct EncodedChunk {
+    Job* job;
+    std::vector<hsize_t> offset;
+    std::vector<unsigned char> bytes;
+    boost::exception_ptr error;
+  };
+
+  // Chunked datasets whose filters EncodeChunk() reproduces.
+  bool is_direct_write(const Job& job) const {
+#ifdef CPPTOOLKIT_H5_DIRECT_CHUNK_WRITE
+    return !job.chunk_shape.empty() && job.number_of_elements() > 0;
+#else
+    return false;
+#endif
+  }
+
+  void ConvertAll(std::vector<std::unique_ptr<Job>>& jobs) {
+    ItemCompletion completion(static_cast<int>(jobs.size()));
+    size_t submitted = 0;
+    try {
+      for (auto& job : jobs) {
+        Job* job_ptr = job.get();
+        pool_.Submit([job_ptr, &completion] {
+          try {
+            job_ptr->Convert();
+            completion.Complete();
+          } catch (...) {
+            completion.Complete(boost::current_exception());
+          }
+        });
+        submitted++;
+      }
+    } catch (...) {
+      // The submitted tasks reference completion, wait for them below.
+      boost::exception_ptr e_ptr = boost::current_exception();
+      for (size_t i = submitted; i < jobs.size(); i++) {
+        completion.Complete(e_ptr);
+      }
+    }
+    completion.Wait();  // rethrows the first failed conversion
+  }
+
+  // Encode on the pool, write on this thread as chunks come back.
+  void WriteChunks(const std::vector<ChunkTask>& tasks) {
+#ifdef CPPTOOLKIT_H5_DIRECT_CHUNK_WRITE
+    std::mutex mutex;
+    std::condition_variable cond_var;
+    std::deque<EncodedChunk> done;
+    boost::exception_ptr first_error;
+    size_t next = 0, in_flight = 0;
+    while (in_flight > 0 || (next < tasks.size() && !first_error)) {
+      while (!first_error && next < tasks.size() &&
+             in_flight < kMaxChunksInFlight_) {
+        try {
+          SubmitChunk(tasks[next], mutex, cond_var, done);
+        } catch (...) {
+          // Stop submitting, the chunks in flight reference done.
+          first_error = boost::current_exception();
+          break;
+        }
+        next++;
+        in_flight++;
+      }
+      if (in_flight == 0) {
+        break;
+      }
+      EncodedChunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond_var.wait(lock, [&done] { return !done.empty(); });
+        chunk = std::move(done.front());
+        done.pop_front();
+      }
+      in_flight--;
+      if (first_error) {
+        continue;  // drain the chunks still referencing this frame
+      }
+      if (chunk.error) {
+        first_error = chunk.error;
+      } else if (H5Dwrite_chunk(chunk.job->dataset->getId(), H5P_DEFAULT, 0,
+                                chunk.offset.data(), chunk.bytes.size(),
+                                chunk.bytes.data()) < 0) {
+        try {
+          CPPTOOLKIT_THROW_EXCEPTION(
+              std::runtime_error("Failed to write a chunk of " +
+                                 chunk.job->path + "."),
+              ErrorLevel::E_ERROR);
+        } catch (...) {
+          first_error = boost::current_exception();
+        }
+      }
+    }
+    if (first_error) {
+      boost::rethrow_exception(first_error);
+    }
+#endif
+  }
+#ifdef CPPTOOLKIT_H5_DIRECT_CHUNK_WRITE
+  // Encode task on the pool and push the result to done.
+  void SubmitChunk(const ChunkTask& task, std::mutex& mutex,
+                   std::condition_variable& cond_var,
+                   std::deque<EncodedChunk>& done) {
+    pool_.Submit([task, &mutex, &cond_var, &done] {
+      EncodedChunk chunk;
+      chunk.job = task.job;
+      try {
+        const Job& job = *task.job;
+        chunk.bytes = EncodeChunk(
+            static_cast<const unsigned char*>(job.data()), job.shape,
+            job.chunk_shape, job.element_size, task.chunk_index, job.options,
+            chunk.offset);
+      } catch (...) {
+        chunk.error = boost::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      done.push_back(std::move(chunk));
+      cond_var.notify_one();
+    });
+  }
+#endif
+
+  HighFive::File& file_;
+  ThreadPool& pool_;
+  const size_t kMaxChunksInFlight_;
+  std::vector<std::unique_ptr<Job>> jobs_;
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_H5_WRITE_SCHEDULER_H_
@@ -11,8 +11,8 @@
 #ifndef CPPTOOLKIT_HANDLE_EXCEPTION_H_
 #define CPPTOOLKIT_HANDLE_EXCEPTION_H_
 
-#include <boost\exception\all.hpp>
-#include <boost\throw_exception.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
 #include <cassert>
 
 #include "log.h"
@@ -70,8 +70,22 @@ inline HandleStatus handle_exception(boost::exception_ptr e_ptr,
   return HandleStatus::STOP;
 }
 
+// Level attached by CPPTOOLKIT_THROW_EXCEPTION, E_UNKNOWN if there is none.
+inline ErrorLevel get_error_level(boost::exception_ptr e_ptr) {
+  try {
+    boost::rethrow_exception(e_ptr);
+  } catch (const boost::exception& e) {
+    const ErrorLevel* level = boost::get_error_info<error_level>(e);
+    if (level) {
+      return *level;
+    }
+  } catch (...) {
+  }
+  return ErrorLevel::E_UNKNOWN;
+}
+
 template <typename T>
-void throw_exception(const T& exception, ErrorLevel level,
+[[noreturn]] void throw_exception(const T& exception, ErrorLevel level,
                      boost::source_location const& loc) {
   boost::throw_exception(
       boost::enable_error_info(exception) << error_level(level), loc);
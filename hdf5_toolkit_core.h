@@ -10,9 +10,28 @@
 #ifndef CPPTOOLKIT_HDF5_TOOLKIT_CORE_H_
 #define CPPTOOLKIT_HDF5_TOOLKIT_CORE_H_
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <complex>
+#include <cstddef>
+#include <filesystem>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <vector>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#if defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#endif
+#endif
 #include <highfive/H5File.hpp>
 #include <highfive/H5Group.hpp>
 #include <xtensor-io/xhighfive.hpp>
@@ -31,7 +50,11 @@
 //#define slots Q_SLOTS
 //#endif
 
+#include <CppToolkit/handle_exception.h>
 #include <CppToolkit/log.h>
+#include <CppToolkit/consumer_metrics.h>
+#include <CppToolkit/item_completion.h>
+#include <CppToolkit/thread_pool.h>
 
 //#include <torch/types.h>
 //#include <torch\all.h>
@@ -148,18 +171,49 @@ namespace cpptoolkit {
 //  return result;
 //}
 
+// Throws std::invalid_argument with E_ERROR unless the whole of str
+// converts to T_key.
 template <typename T_key>
 inline T_key ConvertToTKey(const std::string& str) {
   // Convert string to T_key
-  std::stringstream ss(str);
-  T_key result;
-  ss >> result;
-  return result;
+  if constexpr (std::is_same<T_key, std::string>::value) {
+    return str;
+  } else if constexpr (std::is_integral<T_key>::value ||
+                       std::is_floating_point<T_key>::value) {
+    // No locale and no stream, dataset names are plain numbers.
+    T_key result{};
+    const char* end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, result);
+    if (ec != std::errc() || ptr != end) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Dataset name \"" + str +
+                                "\" is not a valid key."),
+          ErrorLevel::E_ERROR);
+    }
+    return result;
+  } else {
+    std::stringstream ss(str);
+    T_key result;
+    if (!(ss >> result) || ss.peek() != std::char_traits<char>::eof()) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Dataset name \"" + str +
+                                "\" is not a valid key."),
+          ErrorLevel::E_ERROR);
+    }
+    return result;
+  }
 }
 
+// Read every dataset of a group into a map keyed by the dataset names.
+// The file is opened once and every dataset is read straight into a
+// preallocated xarray. With a pool, the reads are spread over its workers.
+// That only pays off with a threadsafe HDF5 build, which still serialises
+// the HDF5 calls but lets allocation and page faults overlap; other builds
+// read serially. Do not pass the pool whose worker is calling.
 template <typename T_value, typename T_key>
 inline std::map<T_key, xt::xarray<T_value>> LoadGroupToMap(
-    const std::string& filename, const std::string& groupName) {
+    const std::string& filename, const std::string& groupName,
+    ThreadPool* pool = nullptr) {
   std::map<T_key, xt::xarray<T_value>> result;
   HighFive::File file(filename, HighFive::File::ReadOnly);
 
@@ -169,19 +223,224 @@ inline std::map<T_key, xt::xarray<T_value>> LoadGroupToMap(
   // Get the number of objects in the group
   std::vector<std::string> objectList = group.listObjectNames();
 
-  // Iterate over each object in the group
+  // Allocate every array first, the map nodes do not move afterwards.
+  std::vector<std::pair<HighFive::DataSet, xt::xarray<T_value>*>> reads;
+  reads.reserve(objectList.size());
   for (const auto& datasetName : objectList) {
-    // Convert datasetName to T_key type
-    T_key key = ConvertToTKey<T_key>(datasetName);
+    if (group.getObjectType(datasetName) != HighFive::ObjectType::Dataset) {
+      continue;
+    }
+    HighFive::DataSet dataset = group.getDataSet(datasetName);
+    // Names such as "01" and "1" convert to the same key, which would
+    // resize an array that is already queued for a read.
+    auto inserted =
+        result.emplace(ConvertToTKey<T_key>(datasetName), xt::xarray<T_value>());
+    if (!inserted.second) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Dataset " + datasetName + " of " + groupName +
+                                " duplicates the key of another dataset."),
+          ErrorLevel::E_ERROR);
+    }
+    xt::xarray<T_value>& array_value = inserted.first->second;
+    array_value.resize(dataset.getDimensions());
+    reads.emplace_back(std::move(dataset), &array_value);
+  }
+
+#ifndef H5_HAVE_THREADSAFE
+  pool = nullptr;
+#endif
+  if (pool == nullptr || reads.size() < 2) {
+    for (auto& read : reads) {
+      if (read.second->size() > 0) {
+        read.first.read_raw(read.second->data());
+      }
+    }
+    return result;
+  }
+  ItemCompletion completion(static_cast<int>(reads.size()));
+  size_t submitted = 0;
+  try {
+    for (auto& read : reads) {
+      pool->Submit([&read, &completion] {
+        try {
+          if (read.second->size() > 0) {
+            read.first.read_raw(read.second->data());
+          }
+          completion.Complete();
+        } catch (...) {
+          completion.Complete(boost::current_exception());
+        }
+      });
+      submitted++;
+    }
+  } catch (...) {
+    // The submitted reads reference reads and completion, wait for them.
+    boost::exception_ptr e_ptr = boost::current_exception();
+    for (size_t i = submitted; i < reads.size(); i++) {
+      completion.Complete(e_ptr);
+    }
+  }
+  completion.Wait();  // rethrows the first failed read
+  return result;
+}
+
+// A regular hyperslab: count blocks of block elements, stride elements
+// apart, starting at offset. Empty stride and block mean 1 per dimension.
+struct H5Hyperslab {
+  std::vector<size_t> offset;
+  std::vector<size_t> count;
+  std::vector<size_t> stride;
+  std::vector<size_t> block;
+
+  // Shape of the selected data, count * block per dimension.
+  std::vector<size_t> shape() const {
+    std::vector<size_t> result(count);
+    for (size_t i = 0; i < result.size() && i < block.size(); i++) {
+      result[i] *= block[i];
+    }
+    return result;
+  }
+};
 
-    // Load the dataset into an xtensor array
-    xt::xarray<T_value> array_value = xt::load_hdf5<xt::xarray<T_value>>(
-        filename, groupName + "/" + datasetName);
+// Throws std::invalid_argument with E_ERROR unless offset and count have
+// the dataset's rank and stride and block are empty or have it too.
+inline void CheckHyperslab(const H5Hyperslab& slab, size_t rank) {
+  auto check = [&](const std::vector<size_t>& values, const char* name,
+                   bool flag_may_be_empty) {
+    if (values.size() == rank || (flag_may_be_empty && values.empty())) {
+      return;
+    }
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::invalid_argument("Hyperslab " + std::string(name) + " has rank " +
+                              std::to_string(values.size()) +
+                              ", the dataset has rank " +
+                              std::to_string(rank) + "."),
+        ErrorLevel::E_ERROR);
+  };
+  check(slab.offset, "offset", false);
+  check(slab.count, "count", false);
+  check(slab.stride, "stride", true);
+  check(slab.block, "block", true);
+}
+
+// Resize out to shape unless it already has it, so a caller-provided
+// xarray or xtensor is reused across reads. Throws std::invalid_argument
+// if out is an xtensor of another rank.
+template <typename Container>
+inline void ResizeToShape(Container& out, const std::vector<size_t>& shape) {
+  if (out.dimension() == shape.size() &&
+      std::equal(shape.begin(), shape.end(), out.shape().begin())) {
+    return;
+  }
+  auto new_shape =
+      xtl::make_sequence<typename Container::shape_type>(shape.size(), 0);
+  if (new_shape.size() != shape.size()) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::invalid_argument("Container has rank " +
+                              std::to_string(new_shape.size()) +
+                              ", the data has rank " +
+                              std::to_string(shape.size()) + "."),
+        ErrorLevel::E_ERROR);
+  }
+  std::copy(shape.begin(), shape.end(), new_shape.begin());
+  out.resize(new_shape);
+}
 
-    // Add to the result map
-    result[key] = std::move(array_value);
+// Read slab of dataset into out, an xt::xarray<T> or xt::xtensor<T, N>
+// that is resized if needed. Only the selected elements are read.
+template <typename Container>
+inline void ReadHyperslab(const HighFive::DataSet& dataset,
+                          const H5Hyperslab& slab, Container& out) {
+  CheckHyperslab(slab, dataset.getDimensions().size());
+  std::vector<size_t> shape = slab.shape();
+  ResizeToShape(out, shape);
+  if (out.size() == 0) {
+    return;
   }
+  std::vector<size_t> ones(slab.offset.size(), 1);
+  HighFive::HyperSlab selection(HighFive::RegularHyperSlab(
+      slab.offset, slab.count, slab.stride.empty() ? ones : slab.stride,
+      slab.block.empty() ? ones : slab.block));
+  dataset.select(selection).read_raw(out.data());
+}
+template <typename T>
+inline xt::xarray<T> ReadHyperslab(const HighFive::DataSet& dataset,
+                                   const H5Hyperslab& slab) {
+  xt::xarray<T> result;
+  ReadHyperslab(dataset, slab, result);
+  return result;
+}
 
+// Read several, e.g. disjoint, hyperslabs of one dataset, one xarray per
+// slab in the order given. With HDF5 1.14 or later all of them are read in
+// a single H5Dread_multi call, otherwise one read per slab.
+template <typename T>
+inline std::vector<xt::xarray<T>> ReadHyperslabs(
+    const HighFive::DataSet& dataset, const std::vector<H5Hyperslab>& slabs) {
+  size_t rank = dataset.getDimensions().size();
+  for (const H5Hyperslab& slab : slabs) {
+    CheckHyperslab(slab, rank);
+  }
+  std::vector<xt::xarray<T>> result(slabs.size());
+#if H5_VERSION_GE(1, 14, 0)
+  // Closes the dataspaces however we leave.
+  struct SpaceIds {
+    std::vector<hid_t> ids;
+    ~SpaceIds() {
+      for (hid_t id : ids) {
+        H5Sclose(id);
+      }
+    }
+  } spaces;
+  std::vector<hid_t> dataset_ids, mem_type_ids, mem_space_ids, file_space_ids;
+  std::vector<void*> buffers;
+  // Keep the type open until H5Dread_multi is done with its id.
+  HighFive::DataType mem_type = HighFive::create_datatype<T>();
+  for (size_t i = 0; i < slabs.size(); i++) {
+    const H5Hyperslab& slab = slabs[i];
+    std::vector<size_t> shape = slab.shape();
+    result[i].resize(shape);
+    if (result[i].size() == 0) {
+      continue;
+    }
+    std::vector<hsize_t> offset(slab.offset.begin(), slab.offset.end());
+    std::vector<hsize_t> count(slab.count.begin(), slab.count.end());
+    std::vector<hsize_t> stride(rank, 1), block(rank, 1);
+    std::copy(slab.stride.begin(), slab.stride.end(), stride.begin());
+    std::copy(slab.block.begin(), slab.block.end(), block.begin());
+    std::vector<hsize_t> mem_shape(shape.begin(), shape.end());
+    hid_t file_space = H5Dget_space(dataset.getId());
+    spaces.ids.push_back(file_space);
+    hid_t mem_space =
+        H5Screate_simple(static_cast<int>(rank), mem_shape.data(), nullptr);
+    spaces.ids.push_back(mem_space);
+    if (file_space < 0 || mem_space < 0 ||
+        H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset.data(),
+                            stride.data(), count.data(), block.data()) < 0) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::runtime_error("Invalid hyperslab selection."),
+          ErrorLevel::E_ERROR);
+    }
+    dataset_ids.push_back(dataset.getId());
+    mem_type_ids.push_back(mem_type.getId());
+    mem_space_ids.push_back(mem_space);
+    file_space_ids.push_back(file_space);
+    buffers.push_back(result[i].data());
+  }
+  if (!buffers.empty() &&
+      H5Dread_multi(buffers.size(), dataset_ids.data(), mem_type_ids.data(),
+                    mem_space_ids.data(), file_space_ids.data(), H5P_DEFAULT,
+                    buffers.data()) < 0) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error("Failed to read hyperslabs of " +
+                           dataset.getPath() + "."),
+        ErrorLevel::E_ERROR);
+  }
+#else
+  for (size_t i = 0; i < slabs.size(); i++) {
+    ReadHyperslab(dataset, slabs[i], result[i]);
+  }
+#endif
   return result;
 }
 
@@ -222,16 +481,136 @@ inline xt::xarray<int> ConvertToXArray(const std::map<int, int>& data) {
   }
   return result;
 }
-inline xt::xarray<int64_t> ConvertToXArray(const std::vector<int64_t>& data) {
-  return xt::adapt(data, {data.size()});
-}
-inline xt::xarray<int> ConvertToXArray(const std::vector<int>& data) {
+template <typename __T>
+inline xt::xarray<__T> ConvertToXArray(const std::vector<__T>& data) {
   return xt::adapt(data, {data.size()});
 }
 inline xt::xarray<int> ConvertToXArray(const int data) {
   return xt::xarray<int>({data});
 }
 
+// Layout and filters of a dataset written by save_data_to_h5(). The
+// default-constructed options write like xt::dump(), contiguous and
+// uncompressed.
+struct H5WriteOptions {
+  bool flag_chunked = false;
+  // Only used when chunked, empty means GuessChunkShape(). Otherwise it
+  // must fit the dataset, see CheckChunkShape().
+  std::vector<size_t> chunk_shape;
+  // 0 disables deflate, 1 (fast) to 9 (small). Needs chunking.
+  unsigned deflate_level = 0;
+  // Byte shuffle before deflate, helps for integer images. Needs chunking.
+  bool flag_shuffle = false;
+  // Value of chunks never written. Only used when chunked.
+  std::optional<double> fill_value;
+  // Replace an existing dataset instead of failing.
+  bool flag_overwrite = false;
+
+  // Chunked, shuffled and deflated at the given level.
+  static H5WriteOptions Compressed(unsigned deflate_level = 4) {
+    H5WriteOptions options;
+    options.flag_chunked = true;
+    options.deflate_level = deflate_level;
+    options.flag_shuffle = true;
+    return options;
+  }
+};
+
+// Chunk shape of about target_bytes for a dataset of the given shape.
+// The last dimensions are kept whole as long as possible and the leading
+// ones are halved first, so a chunk of an image stack holds whole frames
+// and reading one frame touches as few chunks as possible.
+inline std::vector<size_t> GuessChunkShape(const std::vector<size_t>& shape,
+                                           size_t element_size,
+                                           size_t target_bytes = 1 << 20) {
+  std::vector<size_t> chunk(shape.size());
+  size_t chunk_bytes = element_size;
+  for (size_t i = 0; i < shape.size(); i++) {
+    chunk[i] = shape[i] > 0 ? shape[i] : 1;
+    chunk_bytes *= chunk[i];
+  }
+  for (size_t i = 0; i < chunk.size() && chunk_bytes > target_bytes; i++) {
+    while (chunk[i] > 1 && chunk_bytes > target_bytes) {
+      chunk_bytes = chunk_bytes / chunk[i] * ((chunk[i] + 1) / 2);
+      chunk[i] = (chunk[i] + 1) / 2;
+    }
+  }
+  return chunk;
+}
+
+// Throws std::invalid_argument unless chunk_shape can chunk a dataset that
+// grows up to max_shape: same rank, no zero and not larger than a fixed
+// dimension. HighFive::DataSpace::UNLIMITED dimensions take any chunk.
+inline void CheckChunkShape(const std::vector<size_t>& chunk_shape,
+                            const std::vector<size_t>& max_shape) {
+  if (chunk_shape.size() != max_shape.size()) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::invalid_argument("Chunk shape has rank " +
+                              std::to_string(chunk_shape.size()) +
+                              ", the dataset has rank " +
+                              std::to_string(max_shape.size()) + "."),
+        ErrorLevel::E_ERROR);
+  }
+  for (size_t i = 0; i < chunk_shape.size(); i++) {
+    if (chunk_shape[i] == 0 ||
+        (max_shape[i] != HighFive::DataSpace::UNLIMITED &&
+         chunk_shape[i] > max_shape[i])) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::invalid_argument("Chunk dimension " + std::to_string(i) +
+                                " is " + std::to_string(chunk_shape[i]) +
+                                ", must be 1 to " +
+                                std::to_string(max_shape[i]) + "."),
+          ErrorLevel::E_ERROR);
+    }
+  }
+}
+
+// Dataset creation properties for options, used by the save_data_to_h5()
+// overloads taking H5WriteOptions. A chunk shape is guessed for shape, or
+// options.chunk_shape is checked against max_shape, which defaults to
+// shape.
+template <typename __T>
+inline HighFive::DataSetCreateProps MakeDataSetCreateProps(
+    const std::vector<size_t>& shape, const H5WriteOptions& options,
+    const std::vector<size_t>& max_shape = {}) {
+  HighFive::DataSetCreateProps props;
+  bool flag_empty = shape.empty();
+  for (auto dim : shape) {
+    flag_empty = flag_empty || dim == 0;
+  }
+  // Scalars and empty datasets cannot be chunked, write them contiguous.
+  if (!options.flag_chunked || flag_empty) {
+    return props;
+  }
+  if (!options.chunk_shape.empty()) {
+    CheckChunkShape(options.chunk_shape, max_shape.empty() ? shape : max_shape);
+  }
+  std::vector<size_t> chunk_shape = options.chunk_shape.empty()
+                                        ? GuessChunkShape(shape, sizeof(__T))
+                                        : options.chunk_shape;
+  props.add(HighFive::Chunking(
+      std::vector<hsize_t>(chunk_shape.begin(), chunk_shape.end())));
+  if (options.flag_shuffle) {
+    props.add(HighFive::Shuffle());
+  }
+  if (options.deflate_level > 0) {
+    props.add(HighFive::Deflate(options.deflate_level));
+  }
+  // Compound and opaque types keep the default fill value of zeros.
+  if constexpr (std::is_arithmetic<__T>::value) {
+    if (options.fill_value) {
+      __T fill_value = static_cast<__T>(*options.fill_value);
+      HighFive::DataType type = HighFive::create_datatype<__T>();
+      if (H5Pset_fill_value(props.getId(), type.getId(), &fill_value) < 0) {
+        CPPTOOLKIT_THROW_EXCEPTION(
+            std::runtime_error("H5Pset_fill_value failed."),
+            ErrorLevel::E_ERROR);
+      }
+    }
+  }
+  return props;
+}
+
 template <typename __T>
 inline void save_data_to_h5(HighFive::File& File, std::string group_name,
                             std::string dataset_name, const __T& data) {
@@ -242,7 +621,7 @@ template <typename __T>
 inline void save_data_to_h5(HighFive::File& File, std::string group_name,
                             std::string dataset_name,
                             const std::map<int, __T>& data) {
-  for (auto pair : data) {
+  for (const auto& pair : data) {
     xt::dump(File, group_name + dataset_name + "/" + std::to_string(pair.first),
              ConvertToXArray(pair.second));
   }
@@ -251,7 +630,7 @@ template <typename __T>
 void save_data_to_h5(HighFive::File& File, std::string group_name,
                      std::string dataset_name,
                      const std::map<std::string, __T>& data) {
-  for (auto pair : data) {
+  for (const auto& pair : data) {
     xt::dump(File, group_name + dataset_name + "/" + (pair.first),
              ConvertToXArray(pair.second));
   }
@@ -261,7 +640,7 @@ inline void save_data_to_h5(HighFive::File& File, std::string group_name,
                             std::string dataset_name,
                             const std::vector<std::vector<__T>>& data) {
   int i = 0;
-  for (auto elem : data) {
+  for (const auto& elem : data) {
     save_data_to_h5(File, group_name + dataset_name + "/", std::to_string(i),
                     elem);
     ++i;
@@ -273,6 +652,473 @@ inline void save_data_to_h5(HighFive::File& File, std::string group_name,
                             const xt::xarray<__T>& data) {
   xt::dump(File, group_name + dataset_name, data);
 }
+// Write data with the layout and filters of options, e.g.
+//   save_data_to_h5(file, "/", "volume", stack, H5WriteOptions::Compressed());
+template <typename __T>
+inline void save_data_to_h5(HighFive::File& File, std::string group_name,
+                            std::string dataset_name,
+                            const xt::xarray<__T>& data,
+                            const H5WriteOptions& options) {
+  std::string path = group_name + dataset_name;
+  if (options.flag_overwrite && File.exist(path)) {
+    File.unlink(path);
+  }
+  std::vector<size_t> shape(data.shape().begin(), data.shape().end());
+  HighFive::DataSet dataset = File.createDataSet<__T>(
+      path, HighFive::DataSpace(shape),
+      MakeDataSetCreateProps<__T>(shape, options));
+  if (data.size() > 0) {
+    dataset.write_raw(data.data());
+  }
+}
+template <typename __T>
+inline void save_data_to_h5(HighFive::File& File, std::string group_name,
+                            std::string dataset_name, const __T& data,
+                            const H5WriteOptions& options) {
+  save_data_to_h5(File, group_name, dataset_name, ConvertToXArray(data),
+                  options);
+}
+
+// Compile-time mapping of C++ types to HDF5 types for the raw save and load
+// functions below, which write straight from contiguous memory:
+//   arithmetic types       the native integer or float type of that size,
+//   std::complex<U>        compound {r, i}, the layout h5py reads,
+//   std::array<U, N>, U[N] U with N appended to the dataset shape,
+//   H5CompoundTraits<T>    compound with the members it describes,
+//   trivially copyable T   opaque of sizeof(T) bytes.
+// Describe a struct as compound so other tools can read its members:
+//   template <>
+//   struct H5CompoundTraits<Peak> {
+//     static void Describe(H5CompoundBuilder<Peak>& builder) {
+//       CPPTOOLKIT_H5_COMPOUND_MEMBER(builder, Peak, x);
+//       CPPTOOLKIT_H5_COMPOUND_MEMBER(builder, Peak, height);
+//     }
+//   };
+
+// Owns an HDF5 identifier of any kind.
+class H5IdGuard {
+ public:
+  explicit H5IdGuard(hid_t id = H5I_INVALID_HID) : id_(id) {}
+  ~H5IdGuard() {
+    if (id_ >= 0) {
+      H5Idec_ref(id_);
+    }
+  }
+  H5IdGuard(const H5IdGuard&) = delete;
+  H5IdGuard& operator=(const H5IdGuard&) = delete;
+  H5IdGuard(H5IdGuard&& other) noexcept : id_(other.id_) {
+    other.id_ = H5I_INVALID_HID;
+  }
+  hid_t get() const { return id_; }
+  bool is_valid() const { return id_ >= 0; }
+
+ private:
+  hid_t id_;
+};
+
+// Returns status, an identifier or herr_t, and throws std::runtime_error
+// with E_ERROR if it is negative.
+template <typename Status>
+inline Status CheckH5Call(Status status, const char* call) {
+  if (status < 0) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error(std::string(call) + " failed."),
+        ErrorLevel::E_ERROR);
+  }
+  return status;
+}
+
+template <typename T>
+struct H5CompoundTraits {};
+
+template <typename T>
+inline H5IdGuard GetH5DataType();
+
+template <typename T>
+class H5CompoundBuilder {
+ public:
+  explicit H5CompoundBuilder(hid_t compound) : compound_(compound) {}
+  // A member of type U at offset, i.e. offsetof(T, member). Use
+  // CPPTOOLKIT_H5_COMPOUND_MEMBER to name the member after the field.
+  template <typename U>
+  void Add(const char* name, size_t offset) {
+    H5IdGuard member_type = GetH5DataType<U>();
+    CheckH5Call(H5Tinsert(compound_, name, offset, member_type.get()),
+                "H5Tinsert");
+  }
+
+ private:
+  hid_t compound_;
+};
+
+#define CPPTOOLKIT_H5_COMPOUND_MEMBER(builder, Type, member) \
+  (builder).template Add<decltype(Type::member)>(#member,     \
+                                                 offsetof(Type, member))
+
+template <typename T, typename = void>
+struct H5HasCompoundTraits : std::false_type {};
+template <typename T>
+struct H5HasCompoundTraits<
+    T, std::void_t<decltype(H5CompoundTraits<T>::Describe(
+           std::declval<H5CompoundBuilder<T>&>()))>> : std::true_type {};
+
+template <typename T>
+struct H5IsComplex : std::false_type {};
+template <typename U>
+struct H5IsComplex<std::complex<U>> : std::true_type {};
+
+// Element type of T and the extents it adds to the dataset shape.
+template <typename T>
+struct H5ElementTraits {
+  using element_type = T;
+  static constexpr size_t kNumberOfElements = 1;
+  static void AppendExtents(std::vector<size_t>&) {}
+};
+template <typename U, size_t N>
+struct H5ElementTraits<std::array<U, N>> {
+  using element_type = typename H5ElementTraits<U>::element_type;
+  static constexpr size_t kNumberOfElements =
+      N * H5ElementTraits<U>::kNumberOfElements;
+  static void AppendExtents(std::vector<size_t>& shape) {
+    shape.push_back(N);
+    H5ElementTraits<U>::AppendExtents(shape);
+  }
+};
+template <typename U, size_t N>
+struct H5ElementTraits<U[N]> : H5ElementTraits<std::array<U, N>> {};
+
+template <typename T>
+inline H5IdGuard GetH5DataType() {
+  if constexpr (std::is_same<T, bool>::value) {
+    return H5IdGuard(H5Tcopy(H5T_NATIVE_UINT8));
+  } else if constexpr (std::is_integral<T>::value) {
+    constexpr bool kSigned = std::is_signed<T>::value;
+    if constexpr (sizeof(T) == 1) {
+      return H5IdGuard(H5Tcopy(kSigned ? H5T_NATIVE_INT8 : H5T_NATIVE_UINT8));
+    } else if constexpr (sizeof(T) == 2) {
+      return H5IdGuard(H5Tcopy(kSigned ? H5T_NATIVE_INT16 : H5T_NATIVE_UINT16));
+    } else if constexpr (sizeof(T) == 4) {
+      return H5IdGuard(H5Tcopy(kSigned ? H5T_NATIVE_INT32 : H5T_NATIVE_UINT32));
+    } else {
+      static_assert(sizeof(T) == 8, "Unsupported integer size.");
+      return H5IdGuard(H5Tcopy(kSigned ? H5T_NATIVE_INT64 : H5T_NATIVE_UINT64));
+    }
+  } else if constexpr (std::is_same<T, float>::value) {
+    return H5IdGuard(H5Tcopy(H5T_NATIVE_FLOAT));
+  } else if constexpr (std::is_same<T, double>::value) {
+    return H5IdGuard(H5Tcopy(H5T_NATIVE_DOUBLE));
+  } else if constexpr (std::is_same<T, long double>::value) {
+    return H5IdGuard(H5Tcopy(H5T_NATIVE_LDOUBLE));
+  } else if constexpr (H5IsComplex<T>::value) {
+    using Part = typename T::value_type;
+    H5IdGuard type(
+        CheckH5Call(H5Tcreate(H5T_COMPOUND, sizeof(T)), "H5Tcreate"));
+    H5IdGuard part_type = GetH5DataType<Part>();
+    CheckH5Call(H5Tinsert(type.get(), "r", 0, part_type.get()), "H5Tinsert");
+    CheckH5Call(H5Tinsert(type.get(), "i", sizeof(Part), part_type.get()),
+                "H5Tinsert");
+    return type;
+  } else if constexpr (!std::is_same<
+                           typename H5ElementTraits<T>::element_type,
+                           T>::value) {
+    // A member such as float xyz[3].
+    using Element = typename H5ElementTraits<T>::element_type;
+    std::vector<size_t> extents;
+    H5ElementTraits<T>::AppendExtents(extents);
+    std::vector<hsize_t> dims(extents.begin(), extents.end());
+    H5IdGuard element_type = GetH5DataType<Element>();
+    return H5IdGuard(CheckH5Call(
+        H5Tarray_create2(element_type.get(),
+                         static_cast<unsigned>(dims.size()), dims.data()),
+        "H5Tarray_create2"));
+  } else if constexpr (H5HasCompoundTraits<T>::value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Compound types must be trivially copyable.");
+    H5IdGuard type(
+        CheckH5Call(H5Tcreate(H5T_COMPOUND, sizeof(T)), "H5Tcreate"));
+    H5CompoundBuilder<T> builder(type.get());
+    H5CompoundTraits<T>::Describe(builder);
+    return type;
+  } else {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Unsupported type for HDF5 data type mapping.");
+    H5IdGuard type(CheckH5Call(H5Tcreate(H5T_OPAQUE, sizeof(T)), "H5Tcreate"));
+    std::string tag = "cpptoolkit opaque " + std::to_string(sizeof(T));
+    H5Tset_tag(type.get(), tag.c_str());
+    return type;
+  }
+}
+
+// Write count values of T, or a block of the given shape, straight from
+// data. Array element types append their extents to the shape, e.g. a
+// std::array<float, 3>* with shape {n} writes an {n, 3} dataset.
+template <typename T>
+inline void save_raw_to_h5(HighFive::File& File, std::string group_name,
+                           std::string dataset_name, const T* data,
+                           std::vector<size_t> shape,
+                           const H5WriteOptions& options = H5WriteOptions()) {
+  using Element = typename H5ElementTraits<T>::element_type;
+  H5ElementTraits<T>::AppendExtents(shape);
+  std::string path = group_name + dataset_name;
+  if (options.flag_overwrite && File.exist(path)) {
+    File.unlink(path);
+  }
+  size_t number_of_elements = 1;
+  for (auto dim : shape) {
+    number_of_elements *= dim;
+  }
+  std::vector<hsize_t> dims(shape.begin(), shape.end());
+  H5IdGuard space(dims.empty() ? H5Screate(H5S_SCALAR)
+                               : H5Screate_simple(static_cast<int>(dims.size()),
+                                                  dims.data(), nullptr));
+  H5IdGuard type = GetH5DataType<Element>();
+  HighFive::DataSetCreateProps create_props =
+      MakeDataSetCreateProps<Element>(shape, options);
+  H5IdGuard link_props(H5Pcreate(H5P_LINK_CREATE));
+  H5Pset_create_intermediate_group(link_props.get(), 1);
+  H5IdGuard dataset(H5Dcreate2(File.getId(), path.c_str(), type.get(),
+                               space.get(), link_props.get(),
+                               create_props.getId(), H5P_DEFAULT));
+  if (!dataset.is_valid()) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error("Failed to create dataset " + path + "."),
+        ErrorLevel::E_ERROR);
+  }
+  if (number_of_elements > 0 &&
+      H5Dwrite(dataset.get(), type.get(), H5S_ALL, H5S_ALL, H5P_DEFAULT,
+               data) < 0) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error("Failed to write dataset " + path + "."),
+        ErrorLevel::E_ERROR);
+  }
+}
+template <typename T>
+inline void save_raw_to_h5(HighFive::File& File, std::string group_name,
+                           std::string dataset_name, const T* data,
+                           size_t count,
+                           const H5WriteOptions& options = H5WriteOptions()) {
+  save_raw_to_h5(File, group_name, dataset_name, data,
+                 std::vector<size_t>{count}, options);
+}
+template <typename T>
+inline void save_raw_to_h5(HighFive::File& File, std::string group_name,
+                           std::string dataset_name,
+                           const std::vector<T>& data,
+                           const H5WriteOptions& options = H5WriteOptions()) {
+  save_raw_to_h5(File, group_name, dataset_name, data.data(), data.size(),
+                 options);
+}
+#ifdef __cpp_lib_span
+template <typename T, size_t Extent>
+inline void save_raw_to_h5(HighFive::File& File, std::string group_name,
+                           std::string dataset_name, std::span<T, Extent> data,
+                           const H5WriteOptions& options = H5WriteOptions()) {
+  save_raw_to_h5(File, group_name, dataset_name,
+                 static_cast<const std::remove_const_t<T>*>(data.data()),
+                 data.size(), options);
+}
+#endif
+
+// Read the dataset at path into count values of T at data, converting
+// numeric types as HDF5 does. Throws if the sizes do not match.
+template <typename T>
+inline void ReadRawFromH5(const HighFive::File& File, const std::string& path,
+                          T* data, size_t count) {
+  using Element = typename H5ElementTraits<T>::element_type;
+  H5IdGuard dataset(H5Dopen2(File.getId(), path.c_str(), H5P_DEFAULT));
+  if (!dataset.is_valid()) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error("Failed to open dataset " + path + "."),
+        ErrorLevel::E_ERROR);
+  }
+  H5IdGuard space(H5Dget_space(dataset.get()));
+  hssize_t number_of_elements = H5Sget_simple_extent_npoints(space.get());
+  if (number_of_elements < 0 ||
+      static_cast<size_t>(number_of_elements) !=
+          count * H5ElementTraits<T>::kNumberOfElements) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::invalid_argument("Buffer size does not match dataset " + path +
+                              "."),
+        ErrorLevel::E_ERROR);
+  }
+  H5IdGuard type = GetH5DataType<Element>();
+  if (number_of_elements > 0 &&
+      H5Dread(dataset.get(), type.get(), H5S_ALL, H5S_ALL, H5P_DEFAULT,
+              data) < 0) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error("Failed to read dataset " + path + "."),
+        ErrorLevel::E_ERROR);
+  }
+}
+#ifdef __cpp_lib_span
+template <typename T, size_t Extent>
+inline void ReadRawFromH5(const HighFive::File& File, const std::string& path,
+                          std::span<T, Extent> data) {
+  ReadRawFromH5(File, path, data.data(), data.size());
+}
+#endif
+// The whole dataset as values of T, e.g. LoadRawFromH5<std::array<float, 3>>
+// for an {n, 3} dataset.
+template <typename T>
+inline std::vector<T> LoadRawFromH5(const HighFive::File& File,
+                                    const std::string& path) {
+  size_t number_of_elements = File.getDataSet(path).getElementCount();
+  std::vector<T> result(number_of_elements /
+                        H5ElementTraits<T>::kNumberOfElements);
+  ReadRawFromH5(File, path, result.data(), result.size());
+  return result;
+}
+
+// Ragged layout: a collection of variable-length sequences is stored in
+// one group holding three datasets instead of one dataset per element,
+//   values   all elements concatenated,
+//   offsets  n + 1 offsets into values, element i is
+//            values[offsets[i], offsets[i + 1]),
+//   keys     the map keys, only for maps.
+// Each dataset is written with one call, which avoids the per-dataset
+// metadata of save_data_to_h5() for collections of many small elements.
+// options apply to values. Load with LoadRaggedVector() or LoadRaggedMap().
+template <typename __T>
+inline void WriteRaggedValues(HighFive::File& File, const std::string& path,
+                              const std::vector<__T>& values,
+                              const std::vector<uint64_t>& offsets,
+                              const H5WriteOptions& options) {
+  if (options.flag_overwrite && File.exist(path)) {
+    File.unlink(path);
+  }
+  std::vector<size_t> shape{values.size()};
+  HighFive::DataSet dataset = File.createDataSet<__T>(
+      path + "/values", HighFive::DataSpace(shape),
+      MakeDataSetCreateProps<__T>(shape, options));
+  if (!values.empty()) {
+    dataset.write_raw(values.data());
+  }
+  File.createDataSet(path + "/offsets", offsets);
+}
+template <typename __T>
+inline void save_ragged_to_h5(HighFive::File& File, std::string group_name,
+                              std::string dataset_name,
+                              const std::vector<std::vector<__T>>& data,
+                              const H5WriteOptions& options = H5WriteOptions()) {
+  std::vector<uint64_t> offsets;
+  offsets.reserve(data.size() + 1);
+  offsets.push_back(0);
+  for (const auto& elem : data) {
+    offsets.push_back(offsets.back() + elem.size());
+  }
+  std::vector<__T> values;
+  values.reserve(offsets.back());
+  for (const auto& elem : data) {
+    values.insert(values.end(), elem.begin(), elem.end());
+  }
+  WriteRaggedValues(File, group_name + dataset_name, values, offsets, options);
+}
+// T_key is arithmetic or std::string.
+template <typename T_key, typename __T>
+inline void save_ragged_to_h5(HighFive::File& File, std::string group_name,
+                              std::string dataset_name,
+                              const std::map<T_key, std::vector<__T>>& data,
+                              const H5WriteOptions& options = H5WriteOptions()) {
+  std::vector<T_key> keys;
+  std::vector<uint64_t> offsets;
+  keys.reserve(data.size());
+  offsets.reserve(data.size() + 1);
+  offsets.push_back(0);
+  for (const auto& pair : data) {
+    keys.push_back(pair.first);
+    offsets.push_back(offsets.back() + pair.second.size());
+  }
+  std::vector<__T> values;
+  values.reserve(offsets.back());
+  for (const auto& pair : data) {
+    values.insert(values.end(), pair.second.begin(), pair.second.end());
+  }
+  std::string path = group_name + dataset_name;
+  WriteRaggedValues(File, path, values, offsets, options);
+  File.createDataSet(path + "/keys", keys);
+}
+
+// Read the values and offsets written by save_ragged_to_h5() and call
+// emit(i, begin, end) for every element i.
+template <typename __T, typename Emit>
+inline void ReadRaggedValues(const HighFive::File& File,
+                             const std::string& path, Emit&& emit) {
+  std::vector<uint64_t> offsets;
+  File.getDataSet(path + "/offsets").read(offsets);
+  HighFive::DataSet dataset = File.getDataSet(path + "/values");
+  std::vector<__T> values(dataset.getElementCount());
+  if (!values.empty()) {
+    dataset.read_raw(values.data());
+  }
+  for (size_t i = 0; i + 1 < offsets.size(); i++) {
+    if (offsets[i] > offsets[i + 1] || offsets[i + 1] > values.size()) {
+      CPPTOOLKIT_THROW_EXCEPTION(
+          std::runtime_error("Corrupt ragged offsets in " + path + "."),
+          ErrorLevel::E_ERROR);
+    }
+    emit(i, values.begin() + offsets[i], values.begin() + offsets[i + 1]);
+  }
+}
+template <typename __T>
+inline std::vector<std::vector<__T>> LoadRaggedVector(
+    const HighFive::File& File, const std::string& path) {
+  std::vector<std::vector<__T>> result;
+  ReadRaggedValues<__T>(File, path, [&result](size_t, auto begin, auto end) {
+    result.emplace_back(begin, end);
+  });
+  return result;
+}
+template <typename T_key, typename __T>
+inline std::map<T_key, std::vector<__T>> LoadRaggedMap(
+    const HighFive::File& File, const std::string& path) {
+  std::vector<T_key> keys;
+  File.getDataSet(path + "/keys").read(keys);
+  // One offset more than keys, so every key gets its values.
+  if (keys.size() + 1 !=
+      File.getDataSet(path + "/offsets").getElementCount()) {
+    CPPTOOLKIT_THROW_EXCEPTION(
+        std::runtime_error("Ragged keys and offsets do not match in " + path +
+                           "."),
+        ErrorLevel::E_ERROR);
+  }
+  std::map<T_key, std::vector<__T>> result;
+  ReadRaggedValues<__T>(
+      File, path, [&result, &keys](size_t i, auto begin, auto end) {
+        result.emplace_hint(result.end(), keys[i],
+                            std::vector<__T>(begin, end));
+      });
+  return result;
+}
+
+inline void save_data_to_h5(HighFive::File& File, std::string group_name,
+                            std::string dataset_name,
+                            const HistogramSnapshot& data) {
+  std::string path = group_name + dataset_name + "/";
+  xt::dump(File, path + "buckets",
+           xt::xarray<uint64_t>(xt::adapt(
+               data.buckets.data(), data.buckets.size(), xt::no_ownership(),
+               std::vector<size_t>{data.buckets.size()})));
+  xt::dump(File, path + "count", xt::xarray<uint64_t>({data.count}));
+  xt::dump(File, path + "sum_ns", xt::xarray<uint64_t>({data.sum_ns}));
+  xt::dump(File, path + "max_ns", xt::xarray<uint64_t>({data.max_ns}));
+}
+// Save one snapshot per group, e.g. dataset_name = "metrics/000042".
+inline void save_data_to_h5(HighFive::File& File, std::string group_name,
+                            std::string dataset_name,
+                            const ConsumerMetricsSnapshot& data) {
+  std::string path = group_name + dataset_name + "/";
+  xt::dump(File, path + "elapsed_s", xt::xarray<double>({data.elapsed_s}));
+  xt::dump(File, path + "items", xt::xarray<uint64_t>({data.items}));
+  xt::dump(File, path + "items_per_second",
+           xt::xarray<double>({data.items_per_second}));
+  xt::dump(File, path + "queue_depth",
+           xt::xarray<uint64_t>({data.queue_depth}));
+  xt::dump(File, path + "max_queue_depth",
+           xt::xarray<uint64_t>({data.max_queue_depth}));
+  save_data_to_h5(File, path, "queue_latency", data.queue_latency);
+  save_data_to_h5(File, path, "process_time", data.process_time);
+  save_data_to_h5(File, path, "lock_wait", data.lock_wait);
+}
 
 
 
@@ -307,14 +1153,58 @@ inline void save_data_to_h5(HighFive::File& File, std::string group_name,
 // }
 
 
+// How SafeHighFiveFile serialises access to HDF5 files.
+enum class H5LockMode {
+  kPerFile,  // one reader-writer lock per canonical file path
+  kGlobal    // one exclusive lock for every file in the process
+};
+
+// How long a SafeHighFiveFile holds its lock.
+enum class H5LockScope {
+  kLifetime,  // from construction to destruction
+  kScoped     // while opening and closing, and while a Lock() lives
+};
+
 /**  
-* @brief Thread-safe HighFive file handler with global access control.  
+* @brief Thread-safe HighFive file handler with per-file access control.  
 * @note Ensure proper lifecycle management for file handling and mutex locks.  
 *  
-* Uses a Meyer's singleton mutex for C++11/14 compatibility.  
+* In H5LockMode::kPerFile, every canonical file path has its own
+* std::shared_mutex. Files opened ReadOnly take it shared, so readers of the
+* same file run in parallel, other modes take it exclusive. Different files
+* never block each other. The HDF5 library is only safe to call from
+* several threads when built threadsafe (H5_HAVE_THREADSAFE), otherwise the
+* default is H5LockMode::kGlobal, one exclusive lock for all files, as
+* before. set_lock_mode() overrides the default, call it before any file
+* is opened.
+*
+* With H5LockScope::kScoped the file stays open but is only locked while a
+* ScopedLock from Lock() lives, so a long-lived reader or writer does not
+* block every other file in kGlobal mode. Hold the lock around every use of
+* get() and of the objects opened through it, including their destruction.
 */  
 class SafeHighFiveFile {  
 public:  
+ // Holds the lock of a file while it lives, see Lock().
+ class ScopedLock {
+  public:
+   ScopedLock() = default;
+   ScopedLock(std::shared_mutex& mutex, bool flag_shared) {
+     if (flag_shared) {
+       shared_lock_ = std::shared_lock<std::shared_mutex>(mutex);
+     } else {
+       unique_lock_ = std::unique_lock<std::shared_mutex>(mutex);
+     }
+   }
+   bool owns_lock() const {
+     return shared_lock_.owns_lock() || unique_lock_.owns_lock();
+   }
+
+  private:
+   std::shared_lock<std::shared_mutex> shared_lock_;
+   std::unique_lock<std::shared_mutex> unique_lock_;
+ };
+
  /**  
   * @brief Construct a new thread-safe file handler  
   * @param filename Path to HDF5 file  
@@ -329,30 +1219,100 @@ public:
   *    - HighFive::File::Overwrite: Common write mode (equivalent to Truncate).  
   *    - HighFive::File::OpenOrCreate: Open in read-write mode or create a new file if it does not exist.
   */  
- explicit SafeHighFiveFile(const std::string& filename, HighFive::File::AccessMode openFlags)
-     : file_lock_(mutex_instance())  // Lock mutex first
- {
+ explicit SafeHighFiveFile(const std::string& filename, HighFive::File::AccessMode openFlags,
+                           H5LockScope lock_scope = H5LockScope::kLifetime)
+     : lock_scope_(lock_scope) {
+   if (lock_mode() == H5LockMode::kGlobal) {
+     mutex_ = global_mutex_instance();
+   } else {
+     mutex_ = file_mutex(filename);
+     flag_shared_ = openFlags == HighFive::File::ReadOnly;
+   }
+   // Lock first, the file is opened under the lock.
+   ScopedLock lock(*mutex_, flag_shared_);
    file_ = std::make_unique<HighFive::File>(filename, openFlags);
+   if (lock_scope_ == H5LockScope::kLifetime) {
+     lock_ = std::move(lock);
+   }
+ }
+ // A kScoped file is closed under its lock, do not hold a Lock() here.
+ ~SafeHighFiveFile() {
+   if (file_ && !lock_.owns_lock()) {
+     ScopedLock lock(*mutex_, flag_shared_);
+     file_.reset();
+   }
  }
  // Prohibit copying  
  SafeHighFiveFile(const SafeHighFiveFile&) = delete;  
  SafeHighFiveFile& operator=(const SafeHighFiveFile&) = delete;  
- // Allow moving  
+ // Allow move construction. A defaulted move assignment would assign
+ // mutex_ first and free the old mutex while it is still locked, and it
+ // would release the old lock before the old file is closed.
  SafeHighFiveFile(SafeHighFiveFile&&) = default;  
- SafeHighFiveFile& operator=(SafeHighFiveFile&&) = default;  
+ SafeHighFiveFile& operator=(SafeHighFiveFile&&) = delete;
  /**  
   * @brief Get the underlying HighFive file object  
   */  
  HighFive::File& get() noexcept { return *file_; }  
  const HighFive::File& get() const noexcept { return *file_; }  
+ // Lock a kScoped file for the lifetime of the result. A kLifetime file is
+ // locked anyway, the result is then empty.
+ ScopedLock Lock() const {
+   if (lock_scope_ == H5LockScope::kLifetime) {
+     return ScopedLock();
+   }
+   return ScopedLock(*mutex_, flag_shared_);
+ }
+
+ static H5LockMode lock_mode() { return lock_mode_instance().load(); }
+ static void set_lock_mode(H5LockMode mode) { lock_mode_instance() = mode; }
 
 private:  
- // Meyer's singleton pattern for mutex initialization  
- static std::mutex& mutex_instance() {  
-   static std::mutex mtx;  
-   return mtx;  
- }  
- std::unique_lock<std::mutex> file_lock_;  // Lock managed by RAII  
+ // Meyer's singletons for C++11/14 compatible static initialization  
+ static std::atomic<H5LockMode>& lock_mode_instance() {
+#ifdef H5_HAVE_THREADSAFE
+   static std::atomic<H5LockMode> mode(H5LockMode::kPerFile);
+#else
+   static std::atomic<H5LockMode> mode(H5LockMode::kGlobal);
+#endif
+   return mode;
+ }
+ static std::shared_ptr<std::shared_mutex> global_mutex_instance() {
+   static std::shared_ptr<std::shared_mutex> mtx =
+       std::make_shared<std::shared_mutex>();
+   return mtx;
+ }
+ // The mutex of a file lives as long as a SafeHighFiveFile holds it.
+ static std::shared_ptr<std::shared_mutex> file_mutex(
+     const std::string& filename) {
+   static std::mutex registry_mutex;
+   static std::map<std::string, std::weak_ptr<std::shared_mutex>> registry;
+   std::error_code error;
+   std::filesystem::path path = std::filesystem::absolute(filename, error);
+   std::string key = std::filesystem::weakly_canonical(path, error).string();
+   if (error) {
+     key = path.lexically_normal().string();
+   }
+   std::lock_guard<std::mutex> lock(registry_mutex);
+   auto iter = registry.find(key);
+   if (iter != registry.end()) {
+     if (auto mtx = iter->second.lock()) {
+       return mtx;
+     }
+   }
+   // A new entry, drop the ones of files nobody holds any more.
+   for (auto it = registry.begin(); it != registry.end();) {
+     it = it->second.expired() ? registry.erase(it) : std::next(it);
+   }
+   auto mtx = std::make_shared<std::shared_mutex>();
+   registry[key] = mtx;
+   return mtx;
+ }
+ // Declared before file_, so the file is closed before the lock is released.
+ std::shared_ptr<std::shared_mutex> mutex_;
+ bool flag_shared_ = false;  // readers share the lock
+ H5LockScope lock_scope_;
+ ScopedLock lock_;  // held for the lifetime with H5LockScope::kLifetime
  std::unique_ptr<HighFive::File> file_;    // File resource  
 };
 
@@ -0,0 +1,155 @@
+/*
+ * item_completion.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * ItemCompletion tells a producer when the items it submitted to a
+ *   RingAsyncConsumer have been processed.
+ *   The caller owns the ItemCompletion (on its stack or in its coroutine
+ *   frame) and passes it with the item, the ring only stores a pointer, so
+ *   no allocation is added per item. One ItemCompletion can track a batch
+ *   of items: construct it with the number of items.
+ *   With C++20 coroutines, co_await the completion. The coroutine is then
+ *   resumed on the consumer thread, so keep the continuation short or move
+ *   it to another thread. Without coroutines, call Wait().
+ *   If ProcessData() throws, or the item is dropped, the exception is
+ *   stored and rethrown by co_await and Wait(). HandleException() still
+ *   handles it on the consumer thread as before.
+ *
+ * Usage example:
+ *
+ *     ItemCompletion done;
+ *     consumer.ProcessDataAsync(std::move(frame), done);
+ *     co_await done;  // or done.Wait();
+ */
+
+#ifndef CPPTOOLKIT_ITEM_COMPLETION_H_
+#define CPPTOOLKIT_ITEM_COMPLETION_H_
+
+#include <boost/exception/all.hpp>
+#include <atomic>
+#include <thread>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define CPPTOOLKIT_HAS_COROUTINE
+#endif
+#endif
+
+namespace cpptoolkit {
+
+class ItemCompletion {
+ public:
+  explicit ItemCompletion(int number_of_items = 1) { Reset(number_of_items); }
+  ItemCompletion(const ItemCompletion&) = delete;
+  ItemCompletion& operator=(const ItemCompletion&) = delete;
+  ItemCompletion(ItemCompletion&&) = delete;
+  ItemCompletion& operator=(ItemCompletion&&) = delete;
+
+  // Only call when nothing is pending on this completion.
+  void Reset(int number_of_items = 1) {
+    error_ = boost::exception_ptr();
+    flag_error_set_.clear();
+    remaining_.store(number_of_items, std::memory_order_relaxed);
+    flag_released_.store(number_of_items <= 0, std::memory_order_relaxed);
+    state_.store(number_of_items > 0 ? kPending : kDone,
+                 std::memory_order_release);
+  }
+
+  // Once true, the consumer no longer touches this object and the owner
+  // may destroy it.
+  bool is_done() const {
+    return flag_released_.load(std::memory_order_acquire);
+  }
+  // Only valid once is_done(). Holds the first error of the batch.
+  boost::exception_ptr error() const { return error_; }
+
+  // Block until every item is processed, then rethrow the first error.
+  void Wait() {
+    int state;
+    while ((state = state_.load(std::memory_order_acquire)) != kDone) {
+#ifdef __cpp_lib_atomic_wait
+      state_.wait(state, std::memory_order_acquire);
+#else
+      std::this_thread::yield();
+#endif
+    }
+    WaitForRelease();
+    if (error_) {
+      boost::rethrow_exception(error_);
+    }
+  }
+
+#ifdef CPPTOOLKIT_HAS_COROUTINE
+  bool await_ready() const noexcept { return is_done(); }
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    handle_ = handle;
+    int expected = kPending;
+    // Fails if the items completed meanwhile, then resume right away.
+    return state_.compare_exchange_strong(expected, kSuspended,
+                                          std::memory_order_acq_rel);
+  }
+  void await_resume() const {
+    WaitForRelease();
+    if (error_) {
+      boost::rethrow_exception(error_);
+    }
+  }
+#endif
+
+  // Called by the consumer once per item, e_ptr is empty on success.
+  void Complete(boost::exception_ptr e_ptr = boost::exception_ptr()) {
+    if (e_ptr && !flag_error_set_.test_and_set(std::memory_order_relaxed)) {
+      error_ = e_ptr;
+    }
+    if (remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    int previous = state_.exchange(kDone, std::memory_order_acq_rel);
+#ifdef CPPTOOLKIT_HAS_COROUTINE
+    if (previous == kSuspended) {
+      // The resumed coroutine may destroy this, release it first.
+      std::coroutine_handle<> handle = handle_;
+      flag_released_.store(true, std::memory_order_release);
+      handle.resume();
+      return;
+    }
+#endif
+    (void)previous;
+#ifdef __cpp_lib_atomic_wait
+    state_.notify_all();
+#endif
+    // Last access to this. A waiter that has seen kDone may still be
+    // inside notify_all() otherwise, and destroy this under our feet.
+    flag_released_.store(true, std::memory_order_release);
+  }
+
+ private:
+  static constexpr int kPending = 0;
+  static constexpr int kSuspended = 1;  // a coroutine awaits
+  static constexpr int kDone = 2;
+
+  std::atomic<int> state_{kPending};
+  std::atomic<int> remaining_{1};
+  std::atomic<bool> flag_released_{false};
+  std::atomic_flag flag_error_set_ = ATOMIC_FLAG_INIT;
+  boost::exception_ptr error_;
+#ifdef CPPTOOLKIT_HAS_COROUTINE
+  std::coroutine_handle<> handle_;
+#endif
+
+  // kDone is published before Complete() is finished with this, spin for
+  // the short rest.
+  void WaitForRelease() const {
+    while (!flag_released_.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_ITEM_COMPLETION_H_
@@ -1,21 +1,19 @@
 #include "locks.h"
+#include <algorithm>
+#include <boost/exception/all.hpp>
 
 namespace cpptoolkit {
 
-  Locks::Locks(int number_of_locks)
+  Locks::Locks(int number_of_locks, WaitStrategy wait_strategy)
     : kNumberOfLocks_(number_of_locks),
-    mutex_(number_of_locks),
-    cond_var_(number_of_locks),
-    flag_(number_of_locks) {
-  for (int i = 0; i < kNumberOfLocks_; i++) {
-    flag_.at(i) = false;
-  }
+    slots_(number_of_locks),
+    wait_strategy_(wait_strategy) {
   return;
 }
 
 void Locks::Reset() {
   for (int i = 0; i < kNumberOfLocks_; i++) {
-    flag_.at(i) = false;
+    slots_[i].flag = false;
   }
   return;
 }
@@ -31,16 +29,50 @@ Locks::~Locks(){
 }
 
 void Locks::Wait(std::unique_lock<std::mutex>& unique_lock, int index) {
-  while (!flag_.at(index)) {
-    cond_var_.at(index).wait(unique_lock);
+  LockSlot& slot = slots_.at(index);
+  if (wait_strategy_ == WaitStrategy::kSpinThenPark && !slot.flag) {
+    // Waiting on the condition variable releases the mutex as well, so the
+    // caller cannot rely on holding it while we spin.
+    unique_lock.unlock();
+    SpinForSignal(slot);
+    unique_lock.lock();
+  }
+  while (!slot.flag) {
+    slot.cond_var.wait(unique_lock);
   }
-  flag_.at(index) = false;
+  slot.flag = false;
+}
+
+bool Locks::SpinForSignal(LockSlot& slot, std::chrono::nanoseconds max_wait) {
+  // On a single core the signalling thread cannot run while we spin.
+  static const bool kFlagMultiCore = std::thread::hardware_concurrency() > 1;
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::nanoseconds spin_time = std::min(spin_time_, max_wait);
+  std::chrono::nanoseconds yield_time = std::min(yield_time_, max_wait);
+  // Check the clock every few rounds only, it costs more than a pause.
+  const int kPausesPerCheck = 64;
+  while (kFlagMultiCore &&
+         std::chrono::steady_clock::now() - start < spin_time) {
+    for (int i = 0; i < kPausesPerCheck; i++) {
+      if (slot.flag.load(std::memory_order_acquire)) {
+        return true;
+      }
+      CpuRelax();
+    }
+  }
+  while (std::chrono::steady_clock::now() - start < yield_time) {
+    if (slot.flag.load(std::memory_order_acquire)) {
+      return true;
+    }
+    std::this_thread::yield();
+  }
+  return slot.flag.load(std::memory_order_acquire);
 }
 
 SafeLockUp::SafeLockUp(Locks& locks, int lock_index)
   : kPtrLocks_(&locks),
     kLockIndex_(lock_index),
-    unique_lock_(locks.mutex_.at(lock_index)) {
+    unique_lock_(locks.slots_.at(lock_index).mutex) {
   flag_lockup_ = true;
   flag_notifyed_ = false;
   flag_waited_ = false;
@@ -57,29 +89,336 @@ SafeLockUp::~SafeLockUp() {
   return;
 }
 
-void SleepWaiter::WaitForCondition(
-    std::function<void(std::unique_lock<std::mutex>&, uint64_t)> waitFunc) {
-  uint64_t key = 0;
+void SleepWaiter::Enqueue(WaitNode* node) {
+  node->prev = tail_;
+  node->next = nullptr;
+  if (tail_ != nullptr) {
+    tail_->next = node;
+  } else {
+    head_ = node;
+  }
+  tail_ = node;
+  number_of_sleepers_++;
+}
+
+void SleepWaiter::Remove(WaitNode* node) {
+  if (node->prev != nullptr) {
+    node->prev->next = node->next;
+  } else {
+    head_ = node->next;
+  }
+  if (node->next != nullptr) {
+    node->next->prev = node->prev;
+  } else {
+    tail_ = node->prev;
+  }
+  node->prev = nullptr;
+  node->next = nullptr;
+  number_of_sleepers_--;
+}
+
+size_t SleepWaiter::WakeSleepers(size_t number_of_threads) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t number_woken = 0;
+  while (head_ != nullptr && number_woken < number_of_threads) {
+    WaitNode* node = head_;
+    Remove(node);
+    node->flag_woken = true;
+    // Notify while holding mutex_, the node is gone once its thread sees
+    // the flag and returns.
+    node->cond_var.notify_one();
+    number_woken++;
+  }
+  return number_woken;
+}
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick)
+    : kTick_(tick > std::chrono::milliseconds(0) ? tick
+                                                 : std::chrono::milliseconds(1)),
+      kStartTime_(std::chrono::steady_clock::now()) {
+  for (auto& head : heads_) {
+    head = kNoNode;
+  }
+  thread_ = std::thread(&TimerWheel::TimerLoop, this);
+}
+
+TimerWheel::~TimerWheel() {
   {
-    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-    key = key_count++;  // Increment the key count
-    // Ensure the key is unique in the map
-    while (map_flag_wake_.count(key) > 0) {
-      key++;
+    std::lock_guard<std::mutex> lock(mutex_);
+    flag_stop_ = true;
+  }
+  cond_var_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+TimerWheel::TimerId TimerWheel::ScheduleOnce(std::chrono::milliseconds delay,
+                                             std::function<void()> callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return Schedule(ToTicks(delay), 0, std::move(callback));
+}
+
+TimerWheel::TimerId TimerWheel::SchedulePeriodic(
+    std::chrono::milliseconds period, std::function<void()> callback,
+    bool flag_fire_now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t period_ticks = std::max<uint64_t>(ToTicks(period), 1);
+  return Schedule(flag_fire_now ? 0 : period_ticks, period_ticks,
+                  std::move(callback));
+}
+
+bool TimerWheel::Cancel(TimerId id) {
+  // Destroyed after the mutex is released.
+  std::function<void()> callback;
+  std::lock_guard<std::mutex> lock(mutex_);
+  TimerNode* node = Find(id);
+  if (node == nullptr) {
+    return false;
+  }
+  callback = std::move(node->callback);
+  uint32_t index = static_cast<uint32_t>(id);
+  Unlink(index);
+  Free(index);
+  return true;
+}
+
+bool TimerWheel::FireNow(TimerId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (Find(id) == nullptr) {
+    return false;
+  }
+  uint32_t index = static_cast<uint32_t>(id);
+  Unlink(index);
+  Link(index, kReadyList);
+  if (wake_tick_ != 0) {
+    cond_var_.notify_one();
+  }
+  return true;
+}
+
+size_t TimerWheel::number_of_timers() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return number_of_timers_;
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(uint64_t delay, uint64_t period,
+                                         std::function<void()>&& callback) {
+  // Catch up first, the thread may have skipped idle ticks.
+  AdvanceTo(NowTicks());
+  uint32_t index;
+  if (free_head_ != kNoNode) {
+    index = free_head_;
+    free_head_ = nodes_[index].next;
+  } else {
+    index = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+  }
+  TimerNode& node = nodes_[index];
+  if (node.generation == 0) {
+    node.generation = 1;  // keeps every TimerId != kInvalidTimer
+  }
+  node.callback = std::move(callback);
+  // current_tick_ is rounded down, one more tick so no timer fires early.
+  node.expiry = current_tick_ + (delay > 0 ? delay + 1 : 0);
+  node.period = period;
+  Insert(index);
+  number_of_timers_++;
+  if (node.expiry < wake_tick_) {
+    cond_var_.notify_one();
+  }
+  return (static_cast<TimerId>(node.generation) << 32) | index;
+}
+
+TimerWheel::TimerNode* TimerWheel::Find(TimerId id) {
+  uint32_t index = static_cast<uint32_t>(id);
+  uint32_t generation = static_cast<uint32_t>(id >> 32);
+  if (index >= nodes_.size() || nodes_[index].generation != generation ||
+      nodes_[index].list < 0) {
+    return nullptr;
+  }
+  return &nodes_[index];
+}
+
+void TimerWheel::Insert(uint32_t index) {
+  TimerNode& node = nodes_[index];
+  if (node.expiry <= current_tick_) {
+    Link(index, kReadyList);
+    return;
+  }
+  uint64_t delta = node.expiry - current_tick_;
+  uint64_t slot_tick = node.expiry;
+  int level = 0;
+  while (level < kNumberOfLevels - 1 &&
+         delta >= (uint64_t(1) << (kBitsPerLevel * (level + 1)))) {
+    level++;
+  }
+  uint64_t range = uint64_t(1) << (kBitsPerLevel * kNumberOfLevels);
+  if (delta >= range) {
+    // Beyond the wheel, park it in the farthest slot and insert it again
+    // when that slot cascades.
+    slot_tick = current_tick_ + range - 1;
+  }
+  int slot = static_cast<int>((slot_tick >> (kBitsPerLevel * level)) &
+                              (kSlotsPerLevel - 1));
+  Link(index, level * kSlotsPerLevel + slot);
+}
+
+void TimerWheel::Link(uint32_t index, int list) {
+  TimerNode& node = nodes_[index];
+  node.list = list;
+  node.prev = kNoNode;
+  node.next = heads_[list];
+  if (node.next != kNoNode) {
+    nodes_[node.next].prev = index;
+  }
+  heads_[list] = index;
+  if (list < kReadyList) {
+    occupied_[list / kSlotsPerLevel] |= uint64_t(1) << (list % kSlotsPerLevel);
+  }
+}
+
+void TimerWheel::Unlink(uint32_t index) {
+  TimerNode& node = nodes_[index];
+  if (node.prev != kNoNode) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.list] = node.next;
+  }
+  if (node.next != kNoNode) {
+    nodes_[node.next].prev = node.prev;
+  }
+  if (node.list < kReadyList && heads_[node.list] == kNoNode) {
+    occupied_[node.list / kSlotsPerLevel] &=
+        ~(uint64_t(1) << (node.list % kSlotsPerLevel));
+  }
+  node.prev = kNoNode;
+  node.next = kNoNode;
+  node.list = -1;
+}
+
+void TimerWheel::Free(uint32_t index) {
+  TimerNode& node = nodes_[index];
+  node.callback = nullptr;
+  node.generation++;
+  node.next = free_head_;
+  free_head_ = index;
+  number_of_timers_--;
+}
+
+uint64_t TimerWheel::ToTicks(std::chrono::milliseconds duration) const {
+  if (duration <= std::chrono::milliseconds(0)) {
+    return 0;
+  }
+  auto ticks = (std::chrono::steady_clock::duration(duration) + kTick_ -
+                std::chrono::steady_clock::duration(1)) / kTick_;
+  return static_cast<uint64_t>(ticks);
+}
+
+uint64_t TimerWheel::NowTicks() const {
+  return static_cast<uint64_t>((std::chrono::steady_clock::now() -
+                                kStartTime_) / kTick_);
+}
+
+uint64_t TimerWheel::NextEventTick() const {
+  // Level 0 slots still ahead in this rotation.
+  int current_slot = static_cast<int>(current_tick_ & (kSlotsPerLevel - 1));
+  for (int slot = current_slot + 1; slot < kSlotsPerLevel; slot++) {
+    if (occupied_[0] & (uint64_t(1) << slot)) {
+      return current_tick_ - current_slot + slot;
+    }
+  }
+  // Otherwise wake at the end of the rotation to cascade.
+  for (int level = 0; level < kNumberOfLevels; level++) {
+    if (occupied_[level] != 0) {
+      return current_tick_ - current_slot + kSlotsPerLevel;
     }
-    map_flag_wake_[key] = false;  // Set the key's flag to false initially
   }
+  return UINT64_MAX;
+}
 
-  // Temp mutex for condition variable
-  std::mutex temp_mutex;
-  std::unique_lock<std::mutex> temp_lk(temp_mutex);
-  waitFunc(temp_lk, key);  // Invoke the waiting logic
+void TimerWheel::AdvanceTo(uint64_t tick) {
+  while (current_tick_ < tick) {
+    uint64_t next = NextEventTick();
+    if (next > tick) {
+      current_tick_ = tick;  // nothing is due in between
+      return;
+    }
+    current_tick_ = next;
+    ProcessTick();
+  }
+}
 
-  {
-    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-    // Clean up: set the key's flag to true and remove it from the map
-    map_flag_wake_[key] = true;
-    map_flag_wake_.erase(key);
+void TimerWheel::ProcessTick() {
+  // Cascade from the highest level down, so timers moved down one level
+  // are cascaded again if they land in a slot that is due now.
+  int top_level = 0;
+  while (top_level < kNumberOfLevels - 1 &&
+         (current_tick_ &
+          ((uint64_t(1) << (kBitsPerLevel * (top_level + 1))) - 1)) == 0) {
+    top_level++;
+  }
+  for (int level = top_level; level >= 0; level--) {
+    int slot = static_cast<int>(
+        (current_tick_ >> (kBitsPerLevel * level)) & (kSlotsPerLevel - 1));
+    int list = level * kSlotsPerLevel + slot;
+    while (heads_[list] != kNoNode) {
+      uint32_t index = heads_[list];
+      Unlink(index);
+      // Level 0 timers are due, Insert() moves them to the ready list.
+      Insert(index);
+    }
+  }
+}
+
+void TimerWheel::TimerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!flag_stop_) {
+    AdvanceTo(NowTicks());
+    if (heads_[kReadyList] == kNoNode) {
+      uint64_t next = NextEventTick();
+      wake_tick_ = next;
+      if (next == UINT64_MAX) {
+        cond_var_.wait(lock);
+      } else {
+        cond_var_.wait_until(lock, kStartTime_ + next * kTick_);
+      }
+      wake_tick_ = 0;
+      continue;
+    }
+    uint32_t index = heads_[kReadyList];
+    Unlink(index);
+    TimerNode& node = nodes_[index];
+    TimerId id = (static_cast<TimerId>(node.generation) << 32) | index;
+    bool flag_periodic = node.period > 0;
+    // Run the callback without the mutex. A periodic timer is back in the
+    // wheel meanwhile, so it can be cancelled or fired from the callback.
+    std::function<void()> callback = std::move(node.callback);
+    if (flag_periodic) {
+      node.expiry = current_tick_ + node.period;
+      Insert(index);
+    } else {
+      Free(index);
+    }
+    lock.unlock();
+    try {
+      if (callback) {
+        callback();
+      }
+    } catch (...) {
+      LOG_ERROR("[TimerWheel]Uncaught exception in timer callback: {}",
+                boost::current_exception_diagnostic_information());
+    }
+    if (!flag_periodic) {
+      callback = nullptr;
+    }
+    lock.lock();
+    if (flag_periodic) {
+      TimerNode* periodic_node = Find(id);
+      if (periodic_node != nullptr) {
+        periodic_node->callback = std::move(callback);
+      }
+    }
   }
 }
 
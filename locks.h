@@ -6,7 +6,8 @@
  *   cyk_phy@mail.ustc.edu.cn
  *
  * Locks is a class to help synchronize threads.
- *   A Locks object can store a mutex-condition_var-flag array 
+ *   A Locks object can store an array of mutex-condition_var-flag
+ *   slots, each on its own cache line,
  *   and provide some functions to lock\hang up\wake threads.
  *   SafeLockUp is a class to provide a safe way to use Locks.
  *   The way to use SafeLockUp is the same as unique_lock.
@@ -19,6 +20,9 @@
  *   When the destructor was called, the object will call Unlock()
  *   if the mutex has not been unlocked and Notify() if the object
  *   has not called Notify() or Wait() before.
+ *   With WaitStrategy::kSpinThenPark, Wait() first spins and yields on
+ *   the flag for a short while before it sleeps on the condition_var,
+ *   which saves the futex wake-up when signals come in quick bursts.
  */
 
 #ifndef CPPTOOLKIT_CAMERA_LOCKS_H_
@@ -28,52 +32,152 @@
   TypeName(const TypeName&); \
   void operator=(const TypeName&)
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <mutex>
 #include <condition_variable>
+#include <memory>
 #include <vector>
 #include <map>
+#include <thread>
+#include "cache_line.h"
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "log.h"
 
 namespace cpptoolkit {
 
+// Tell the CPU we are in a spin loop.
+inline void CpuRelax() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#else
+  std::this_thread::yield();
+#endif
+}
+
+// How Locks::Wait() waits for a signal.
+enum class WaitStrategy {
+  kBlock,         // Park on the condition variable right away.
+  kSpinThenPark   // Spin, then yield, then park. For bursty hand-offs where
+                  // the signal usually arrives within microseconds.
+};
+
+// One lock index. Every slot has its own cache line, so threads using
+// different indices of the same Locks do not false-share.
+struct alignas(kCacheLineSize) LockSlot {
+  std::mutex mutex;
+  std::condition_variable cond_var;
+  std::atomic<bool> flag{false};
+};
+
 class Locks {
 public:
   friend class SafeLockUp;
-  explicit Locks(int number_of_locks = 1);
+  explicit Locks(int number_of_locks = 1,
+                 WaitStrategy wait_strategy = WaitStrategy::kBlock);
   ~Locks();
 
   void Reset();
   void signal_off(int index) { 
-    flag_.at(index) = false;
+    slots_.at(index).flag = false;
+  }
+
+  // For WaitStrategy::kSpinThenPark: spin for spin_time, then yield until
+  // yield_time has passed since the wait started, then park.
+  void set_wait_strategy(
+      WaitStrategy wait_strategy,
+      std::chrono::nanoseconds spin_time = std::chrono::microseconds(20),
+      std::chrono::nanoseconds yield_time = std::chrono::microseconds(100)) {
+    wait_strategy_ = wait_strategy;
+    spin_time_ = spin_time;
+    yield_time_ = yield_time;
   }
+  WaitStrategy wait_strategy() const { return wait_strategy_; }
 
   void lockup(int index) {
-    mutex_.at(index).lock();
+    slots_.at(index).mutex.lock();
   }
 
   // wait_then_signal_of
   void Wait(std::unique_lock<std::mutex>& unique_lock, int index);
+
+  // wait_then_signal_of, returns false if abs_time is reached first.
+  template <class _Clock, class _Duration>
+  bool WaitUntil(std::unique_lock<std::mutex>& unique_lock, int index,
+                 const std::chrono::time_point<_Clock, _Duration>& abs_time) {
+    LockSlot& slot = slots_.at(index);
+    if (wait_strategy_ == WaitStrategy::kSpinThenPark && !slot.flag) {
+      // Never spin past abs_time.
+      auto remaining = abs_time - _Clock::now();
+      if (remaining > remaining.zero()) {
+        unique_lock.unlock();
+        SpinForSignal(slot, remaining < yield_time_
+                                ? std::chrono::duration_cast<
+                                      std::chrono::nanoseconds>(remaining)
+                                : yield_time_);
+        unique_lock.lock();
+      }
+    }
+    while (!slot.flag) {
+      if (slot.cond_var.wait_until(unique_lock, abs_time) ==
+              std::cv_status::timeout &&
+          !slot.flag) {
+        return false;
+      }
+    }
+    slot.flag = false;
+    return true;
+  }
+
+  // Wait on condition variable index until pred() holds. The flag is not
+  // used, so any number of threads can wait for the same condition.
+  template <class _Clock, class _Duration, class _Predicate>
+  bool WaitUntil(std::unique_lock<std::mutex>& unique_lock, int index,
+                 const std::chrono::time_point<_Clock, _Duration>& abs_time,
+                 _Predicate pred) {
+    return slots_.at(index).cond_var.wait_until(unique_lock, abs_time, pred);
+  }
   
   // signal_on
   void notify(int index) {
-    flag_.at(index) = true;
-    cond_var_.at(index).notify_one();
+    slots_.at(index).flag = true;
+    slots_.at(index).cond_var.notify_one();
   }
 
   // signal_on_and_unlock
   void notify_and_unlock(int index) {
-    flag_.at(index) = true;
-    mutex_.at(index).unlock();
-    cond_var_.at(index).notify_one();
+    LockSlot& slot = slots_.at(index);
+    slot.flag = true;
+    slot.mutex.unlock();
+    slot.cond_var.notify_one();
   }
   void NotifyAll(); // signal_on_all
 
+  // Wake every thread waiting on index with a predicate, flag unchanged.
+  void notify_all(int index) { slots_.at(index).cond_var.notify_all(); }
+
 private:
   const int kNumberOfLocks_;
 
-  std::vector<std::mutex> mutex_;
-  std::vector<std::condition_variable> cond_var_;
-  std::vector<bool> flag_;
+  std::vector<LockSlot> slots_;
+
+  WaitStrategy wait_strategy_;
+  std::chrono::nanoseconds spin_time_{std::chrono::microseconds(20)};
+  std::chrono::nanoseconds yield_time_{std::chrono::microseconds(100)};
+
+  // Spin and yield without the mutex until the flag is set or the spin
+  // budget is used up, but never longer than max_wait. Returns true if the
+  // flag was seen.
+  bool SpinForSignal(LockSlot& slot, std::chrono::nanoseconds max_wait =
+                                         std::chrono::nanoseconds::max());
 
 };
 
@@ -86,6 +190,23 @@ public:
     kPtrLocks_->Wait(unique_lock_, kLockIndex_);
     flag_waited_ = true;
   }
+
+  // Returns false if abs_time is reached before the signal.
+  template <class _Clock, class _Duration>
+  bool wait_until(const std::chrono::time_point<_Clock, _Duration>& abs_time) {
+    flag_waited_ = true;
+    return kPtrLocks_->WaitUntil(unique_lock_, kLockIndex_, abs_time);
+  }
+
+  // Wait on condition variable cond_index of the same Locks while holding
+  // this lock's mutex, until pred() holds. Returns pred().
+  template <class _Clock, class _Duration, class _Predicate>
+  bool wait_until(int cond_index,
+                  const std::chrono::time_point<_Clock, _Duration>& abs_time,
+                  _Predicate pred) {
+    flag_waited_ = true;
+    return kPtrLocks_->WaitUntil(unique_lock_, cond_index, abs_time, pred);
+  }
   
   void unlock() {
     unique_lock_.unlock();
@@ -98,7 +219,7 @@ public:
   }
   
   void notify_and_unlock() { // signal_on_and_unlock
-    kPtrLocks_->flag_.at(kLockIndex_) = true;
+    kPtrLocks_->slots_.at(kLockIndex_).flag = true;
     unlock();
     notify();
   }
@@ -127,6 +248,12 @@ private:
  * useful in multi-threaded scenarios where it is beneficial to be able to
  * respond to external events during a waiting period.
  *
+ * Every sleeping thread links a node on its own stack into an intrusive
+ * FIFO list and parks on the node's own condition variable. Sleeping and
+ * waking do not allocate, take the list mutex only for O(1) work, and a
+ * wake up only notifies the threads it actually wakes. wake_one() and
+ * wake_n() wake the longest sleeping threads first.
+ *
  * The class is non-copyable and non-movable to ensure unique instances and
  * maintain thread safety.
  *
@@ -145,6 +272,7 @@ private:
  *     sleeper.sleep_for(5000); // Sleep for 5 seconds
  *     // In another thread
  *     sleeper.wake_up(); // Wake all sleeping threads prematurely
+ *     sleeper.wake_one(); // or only the longest sleeping one
  */
 class SleepWaiter {
  public:
@@ -156,118 +284,176 @@ class SleepWaiter {
   SleepWaiter(SleepWaiter&&) = delete;
   SleepWaiter& operator=(SleepWaiter&&) = delete;
 
-  //void sleep() {
-  //  uint64_t key = 0;
-  //  {
-  //    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-  //    key = key_count++;
-  //    // find an unexisted key
-  //    while (map_flag_wake_.count(key) > 0) {
-  //      key++;
-  //    }
-  //    map_flag_wake_[key] = false;
-  //  }
-  //  std::mutex temp_mutex;
-  //  std::unique_lock<std::mutex> temp_lk(temp_mutex);
-  //  cond_var_.wait(temp_lk, [this, key] { return map_flag_wake_[key]; });
-  //  {
-  //    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-  //    map_flag_wake_[key] = true;
-  //    map_flag_wake_.erase(key);
-  //  }
-  //}
-
-  //void sleep_for(uint64_t milliseconds) {
-  //  uint64_t key = 0;
-  //  {
-  //    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-  //    key = key_count++;
-  //    // find an unexisted key
-  //    while (map_flag_wake_.count(key) > 0) {
-  //      key++;
-  //    }
-  //    map_flag_wake_[key] = false;
-  //  }
-  //  std::mutex temp_mutex;
-  //  std::unique_lock<std::mutex> temp_lk(temp_mutex);
-  //  cond_var_.wait_for(temp_lk, std::chrono::milliseconds(milliseconds),
-  //                     [this,key] { return map_flag_wake_[key]; });
-  //  {
-  //    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-  //    map_flag_wake_[key] = true;
-  //    map_flag_wake_.erase(key);
-  //  }
-  //}
-
-  //template <class _Clock, class _Duration>
-  //void sleep_until(const std::chrono::time_point<_Clock, _Duration>& _Abs_time) { 
-  //  uint64_t key = 0;
-  //  {
-  //    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-  //    key = key_count++;
-  //    // find an unexisted key
-  //    while (map_flag_wake_.count(key) > 0) {
-  //      key++;
-  //    }
-  //    map_flag_wake_[key] = false;
-  //  }
-  //  std::mutex temp_mutex;
-  //  std::unique_lock<std::mutex> temp_lk(temp_mutex);
-  //  cond_var_.wait_until(temp_lk, _Abs_time,
-  //                     [this, key] { return map_flag_wake_[key]; });
-  //  {
-  //    std::lock_guard<std::mutex> lock(mutex_for_flag_);
-  //    map_flag_wake_[key] = true;
-  //    map_flag_wake_.erase(key);
-  //  }
-  //}
-
   // Sleep indefinitely until woken up
   void sleep() {
-    WaitForCondition([this](std::unique_lock<std::mutex>& lk, uint64_t key) {
-      cond_var_.wait(lk, [this, key] { return map_flag_wake_[key]; });
-    });
+    WaitNode node;
+    std::unique_lock<std::mutex> lock(mutex_);
+    Enqueue(&node);
+    node.cond_var.wait(lock, [&node] { return node.flag_woken; });
   }
 
-  // Sleep for a specified duration in milliseconds
-  void sleep_for(uint64_t milliseconds) {
-    WaitForCondition(
-        [this, milliseconds](std::unique_lock<std::mutex>& lk, uint64_t key) {
-          cond_var_.wait_for(lk, std::chrono::milliseconds(milliseconds),
-                             [this, key] { return map_flag_wake_[key]; });
-        });
+  // Sleep for a specified duration in milliseconds.
+  // Returns true if woken up, false if the time ran out.
+  bool sleep_for(uint64_t milliseconds) {
+    return sleep_until(std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(milliseconds));
   }
 
-  // Sleep until a specified time point
+  // Sleep until a specified time point.
+  // Returns true if woken up, false if the time ran out.
   template <class _Clock, class _Duration>
-  void sleep_until(
+  bool sleep_until(
       const std::chrono::time_point<_Clock, _Duration>& _Abs_time) {
-    WaitForCondition(
-        [this, &_Abs_time](std::unique_lock<std::mutex>& lk, uint64_t key) {
-          cond_var_.wait_until(lk, _Abs_time,
-                               [this, key] { return map_flag_wake_[key]; });
-        });
+    WaitNode node;
+    std::unique_lock<std::mutex> lock(mutex_);
+    Enqueue(&node);
+    if (!node.cond_var.wait_until(lock, _Abs_time,
+                                  [&node] { return node.flag_woken; })) {
+      Remove(&node);
+      return false;
+    }
+    return true;
   }
 
-  void wake_up() {
-    {
-      std::lock_guard<std::mutex> lock(mutex_for_flag_);
-      for (auto& pair : map_flag_wake_) {
-        pair.second = true;
-      }
-      cond_var_.notify_all();
-    }
+  // Wake all sleeping threads, returns the number woken.
+  size_t wake_up() { return WakeSleepers(SIZE_MAX); }
+  // Wake the longest sleeping thread, returns false if none was sleeping.
+  bool wake_one() { return WakeSleepers(1) == 1; }
+  // Wake up to number_of_threads sleeping threads, returns the number woken.
+  size_t wake_n(size_t number_of_threads) {
+    return WakeSleepers(number_of_threads);
+  }
+
+  size_t number_of_sleepers() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return number_of_sleepers_;
   }
 
  private:
-  std::mutex mutex_for_flag_;
+  // Lives on the sleeping thread's stack while it is in the list.
+  struct WaitNode {
+    std::condition_variable cond_var;
+    WaitNode* prev = nullptr;
+    WaitNode* next = nullptr;
+    bool flag_woken = false;
+  };
+
+  // Enqueue() and Remove() need mutex_ locked.
+  void Enqueue(WaitNode* node);
+  void Remove(WaitNode* node);
+  // Locks mutex_ itself.
+  size_t WakeSleepers(size_t number_of_threads);
+
+  std::mutex mutex_;
+  WaitNode* head_ = nullptr;  // longest sleeping
+  WaitNode* tail_ = nullptr;
+  size_t number_of_sleepers_ = 0;
+};
+
+/**
+ * @brief TimerWheel runs many one-shot and periodic timers on one thread,
+ * instead of one thread per timer looping on SleepWaiter::sleep_for().
+ *
+ * Timers live in a hierarchical timing wheel of kNumberOfLevels levels with
+ * kSlotsPerLevel slots each, level 0 counting single ticks. Schedule and
+ * Cancel only link or unlink a node of an intrusive list, so both are O(1).
+ * The thread sleeps until the next occupied tick, so idle timers cost
+ * nothing but a wake up every kSlotsPerLevel ticks to cascade the higher
+ * levels.
+ *
+ * Callbacks run on the wheel thread, one at a time, so keep them short or
+ * hand the work to a ThreadPool. A timer can be cancelled or fired early
+ * from any thread, including from its own callback. Cancel() does not wait
+ * for a callback that is already running.
+ *
+ * Usage example:
+ *
+ *     TimerWheel timers;
+ *     auto id = timers.SchedulePeriodic(std::chrono::milliseconds(100),
+ *                                       [&] { PollStatus(); });
+ *     timers.FireNow(id);  // poll now, like SleepWaiter::wake_up()
+ *     timers.Cancel(id);
+ */
+class TimerWheel {
+ public:
+  using TimerId = uint64_t;
+  static constexpr TimerId kInvalidTimer = 0;
+
+  explicit TimerWheel(
+      std::chrono::milliseconds tick = std::chrono::milliseconds(1));
+  // Stops the thread, timers that have not fired yet are dropped.
+  ~TimerWheel();
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Delays and periods are rounded up to whole ticks.
+  TimerId ScheduleOnce(std::chrono::milliseconds delay,
+                       std::function<void()> callback);
+  TimerId SchedulePeriodic(std::chrono::milliseconds period,
+                           std::function<void()> callback,
+                           bool flag_fire_now = false);
+
+  // Returns false if the timer has already fired (one-shot) or is unknown.
+  bool Cancel(TimerId id);
+  // Fire the timer as soon as possible. A periodic timer then continues
+  // one period after this firing.
+  bool FireNow(TimerId id);
+
+  size_t number_of_timers();
+
+ private:
+  static constexpr int kNumberOfLevels = 4;
+  static constexpr int kBitsPerLevel = 6;
+  static constexpr int kSlotsPerLevel = 1 << kBitsPerLevel;
+  static constexpr uint32_t kNoNode = UINT32_MAX;
+  // Slot list for timers due now.
+  static constexpr int kReadyList = kNumberOfLevels * kSlotsPerLevel;
+
+  struct TimerNode {
+    std::function<void()> callback;
+    uint64_t expiry = 0;  // in ticks
+    uint64_t period = 0;  // in ticks, 0 for one-shot
+    uint32_t generation = 0;
+    uint32_t prev = kNoNode;
+    uint32_t next = kNoNode;
+    int list = -1;  // slot list index, -1 when free or firing
+  };
+
+  // These need mutex_ locked.
+  TimerId Schedule(uint64_t delay, uint64_t period,
+                   std::function<void()>&& callback);
+  TimerNode* Find(TimerId id);
+  void Insert(uint32_t index);
+  void Link(uint32_t index, int list);
+  void Unlink(uint32_t index);
+  void Free(uint32_t index);
+  uint64_t NextEventTick() const;
+  void AdvanceTo(uint64_t tick);
+  void ProcessTick();
+  // Only read constants, no lock needed.
+  uint64_t ToTicks(std::chrono::milliseconds duration) const;
+  uint64_t NowTicks() const;
+
+  void TimerLoop();
+
+  const std::chrono::steady_clock::duration kTick_;
+  const std::chrono::steady_clock::time_point kStartTime_;
+
+  std::mutex mutex_;
   std::condition_variable cond_var_;
-  uint64_t key_count = 0;
-  std::map<int,bool> map_flag_wake_;
+  bool flag_stop_ = false;
+  uint64_t current_tick_ = 0;  // last processed tick
+  uint64_t wake_tick_ = 0;     // tick the thread sleeps until, 0 if awake
+  std::vector<TimerNode> nodes_;
+  uint32_t free_head_ = kNoNode;
+  size_t number_of_timers_ = 0;
+  // Heads of the slot lists plus the ready list.
+  uint32_t heads_[kReadyList + 1];
+  // Bit i is set if slot i of the level is not empty.
+  uint64_t occupied_[kNumberOfLevels] = {};
 
-  // Common function to handle key acquisition, setting, and cleanup
-  void WaitForCondition(
-      std::function<void(std::unique_lock<std::mutex>&, uint64_t)> waitFunc);
+  std::thread thread_;
 };
 
 }
@@ -1,10 +1,39 @@
 #include "log.h"
+#include <spdlog/async.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
+#include <atomic>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
 #include "date_time.h"
 
 namespace cpptoolkit {
 
+namespace {
+
+// Flush once, whichever of exit or terminate comes first.
+std::atomic_flag flag_logger_shut_down = ATOMIC_FLAG_INIT;
+std::terminate_handler previous_terminate_handler = nullptr;
+
+void FlushOnTerminate() {
+  ShutdownLogger();
+  if (previous_terminate_handler != nullptr) {
+    previous_terminate_handler();
+  }
+  std::abort();
+}
+
+void InstallShutdownHandlers() {
+  static std::once_flag flag_installed;
+  std::call_once(flag_installed, [] {
+    std::atexit(ShutdownLogger);
+    previous_terminate_handler = std::set_terminate(FlushOnTerminate);
+  });
+}
+
+}  // namespace
+
 spdlog::filename_t GetLogFileName(spdlog::filename_t base_filename) {
   cpptoolkit::DateTime time;
 #if defined(_WIN32) && defined(SPDLOG_WCHAR_FILENAMES)
@@ -22,7 +51,11 @@ void InitLogger(
   spdlog::level::level_enum file_log_level,
   spdlog::level::level_enum logger_log_level,
   std::size_t max_file_size,
-  std::size_t max_file_number) {
+  std::size_t max_file_number,
+  LogMode log_mode,
+  std::size_t async_queue_size,
+  std::size_t async_thread_count,
+  std::chrono::seconds flush_interval) {
   auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
   console_sink->set_level(console_log_level);
 
@@ -31,11 +64,57 @@ void InitLogger(
 
 
   spdlog::sinks_init_list sinks_list = { console_sink, file_sink };
-  auto logger = std::make_shared<spdlog::logger>("new_default", sinks_list);
+  std::shared_ptr<spdlog::logger> logger;
+  if (log_mode == LogMode::kSync) {
+    logger = std::make_shared<spdlog::logger>("new_default", sinks_list);
+  } else {
+    // Write out what the previous logger still holds before its thread
+    // pool is replaced.
+    spdlog::default_logger()->flush();
+    spdlog::init_thread_pool(async_queue_size,
+                             async_thread_count > 0 ? async_thread_count : 1);
+    logger = std::make_shared<spdlog::async_logger>(
+        "new_default", sinks_list, spdlog::thread_pool(),
+        log_mode == LogMode::kAsyncBlock
+            ? spdlog::async_overflow_policy::block
+            : spdlog::async_overflow_policy::overrun_oldest);
+    flag_logger_shut_down.clear();
+    InstallShutdownHandlers();
+  }
   logger->set_level(logger_log_level);
   spdlog::set_default_logger(logger);
   spdlog::set_pattern("[%H:%M:%S.%e] [thread %t] [%^%l%$] %v");
   spdlog::flush_on(console_log_level);
+  if (log_mode != LogMode::kSync && flush_interval.count() > 0) {
+    spdlog::flush_every(flush_interval);
+  }
+}
+
+void ShutdownLogger() {
+  if (flag_logger_shut_down.test_and_set()) {
+    return;
+  }
+  std::shared_ptr<spdlog::logger> logger = spdlog::default_logger();
+  if (!logger) {
+    return;
+  }
+  if (!std::dynamic_pointer_cast<spdlog::async_logger>(logger)) {
+    logger->flush();
+    return;
+  }
+  // Later messages are written synchronously by the same sinks.
+  auto sync_logger = std::make_shared<spdlog::logger>(
+      logger->name(), logger->sinks().begin(), logger->sinks().end());
+  sync_logger->set_level(logger->level());
+  sync_logger->flush_on(spdlog::level::trace);
+  spdlog::set_default_logger(sync_logger);
+  // Other threads may still hold the raw pointer of the async logger, keep
+  // it alive. Its messages are dropped once the pool is gone.
+  static std::shared_ptr<spdlog::logger> retired_logger;
+  retired_logger = logger;
+  logger->flush();
+  // The pool writes out its queue before its threads are joined.
+  spdlog::details::registry::instance().set_tp(nullptr);
 }
 
 std::string GetIdStr(std::thread* ptr_thread){
@@ -11,9 +11,10 @@
 #ifndef CPPTOOLKIT_LOG_H_
 #define CPPTOOLKIT_LOG_H_
 
-#include <spdlog\spdlog.h>
+#include <spdlog/spdlog.h>
 #include <fmt/ostream.h>
 #include <fmt/chrono.h>
+#include <chrono>
 #include <sstream>
 
 namespace cpptoolkit {
@@ -27,6 +28,22 @@ namespace cpptoolkit {
 
 spdlog::filename_t GetLogFileName(spdlog::filename_t base_filename);
 
+// How the default logger writes.
+// kSync formats and writes on the calling thread under the sink mutex.
+// The async modes only push the message to a preallocated queue and
+// async_thread_count background threads write it. When the queue is full,
+// kAsyncBlock waits for space and kAsyncOverrunOldest drops the oldest
+// message. With more than one thread the order of messages is not kept.
+// In async mode the queue is flushed at exit and on std::terminate, see
+// InitLogger(). Flushing on a crash is out of scope: no signal handlers are
+// installed, and messages still queued when SIGSEGV, SIGABRT or another
+// fatal signal kills the process are lost. Use kSync where the last lines
+// before a crash matter, or call ShutdownLogger() from your own shutdown
+// path to keep them on a controlled stop.
+enum class LogMode { kSync, kAsyncBlock, kAsyncOverrunOldest };
+
+// The async arguments are only used by the async modes. Those also flush
+// every flush_interval and install the shutdown handlers once.
 void InitLogger(
   spdlog::filename_t log_filepath = "logs",
   spdlog::filename_t log_filename = "default_log.txt",
@@ -34,7 +51,17 @@ void InitLogger(
   spdlog::level::level_enum file_log_level = spdlog::level::trace,
   spdlog::level::level_enum logger_log_level = spdlog::level::trace,
   std::size_t max_file_size = 1024 * 1024 * 5,
-  std::size_t max_file_number = 200);
+  std::size_t max_file_number = 200,
+  LogMode log_mode = LogMode::kSync,
+  std::size_t async_queue_size = 8192,
+  std::size_t async_thread_count = 1,
+  std::chrono::seconds flush_interval = std::chrono::seconds(1));
+
+// Write out everything queued and stop the async threads, later messages
+// are written synchronously. Called at exit and on std::terminate, call it
+// earlier to flush on a controlled shutdown. Not async-signal-safe, so do
+// not call it from a signal handler.
+void ShutdownLogger();
 
 std::string GetIdStr(std::thread* ptr_thread);
 
@@ -0,0 +1,213 @@
+/*
+ * parallel_async_consumer.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * ParallelAsyncConsumer runs ProcessItem() on up to K workers of a shared
+ *   ThreadPool. The consumer thread of RingAsyncConsumer only dispatches:
+ *   every item gets a sequence number and is handed to the pool. Results
+ *   are passed to EmitResult() one at a time, in sequence order when
+ *   flag_ordered is set (a reorder stage holds early results back), or in
+ *   completion order otherwise.
+ *   Exceptions thrown on a worker are passed back to the consumer thread
+ *   and go through HandleException() there, like any other exception
+ *   thrown by ProcessData().
+ */
+
+#ifndef CPPTOOLKIT_PARALLEL_ASYNC_CONSUMER_H_
+#define CPPTOOLKIT_PARALLEL_ASYNC_CONSUMER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <utility>
+#include "ring_async_consumer.h"
+#include "thread_pool.h"
+
+namespace cpptoolkit {
+
+template <typename T, typename R>
+class ParallelAsyncConsumer : public RingAsyncConsumer<T> {
+ public:
+  explicit ParallelAsyncConsumer(
+      std::size_t number_of_workers, bool flag_ordered = true,
+      ThreadPool& pool = ThreadPool::GlobalInstance(),
+      std::size_t capacity = 1024)
+      : RingAsyncConsumer<T>(capacity),
+        kNumberOfWorkers_(number_of_workers > 0 ? number_of_workers : 1),
+        kFlagOrdered_(flag_ordered),
+        pool_(pool) {}
+  virtual ~ParallelAsyncConsumer() { this->Close(); };
+  ParallelAsyncConsumer(const ParallelAsyncConsumer&) = delete;
+  ParallelAsyncConsumer& operator=(const ParallelAsyncConsumer&) = delete;
+
+ protected:
+  // Runs on a pool worker, concurrently with other items.
+  virtual R ProcessItem(T& data) = 0;
+  // Never called concurrently. In sequence order if flag_ordered is set.
+  // Runs on a worker without any lock of the consumer held, so it may block
+  // or feed another consumer.
+  virtual void EmitResult(R&& result, std::uint64_t sequence) = 0;
+
+  // Dispatch loaded_data_ to the pool.
+  virtual void ProcessData();
+  virtual void PostCoreLoop() {
+    RingAsyncConsumer<T>::PostCoreLoop();
+    WaitForWorkers(0);
+    while (true) {
+      try {
+        if (!RethrowWorkerException()) {
+          break;
+        }
+      } catch (...) {
+        this->HandleException(boost::current_exception());
+      }
+    }
+  }
+
+  // Rethrows the first exception caught on a worker. Returns false if
+  // there is none.
+  bool RethrowWorkerException();
+
+ private:
+  const std::size_t kNumberOfWorkers_;
+  const bool kFlagOrdered_;
+  ThreadPool& pool_;
+
+  std::uint64_t next_sequence_ = 0;  // consumer thread only
+  std::mutex mutex_workers_;
+  std::condition_variable cond_var_workers_;
+  std::size_t in_flight_ = 0;
+  std::uint64_t next_emit_sequence_ = 0;
+  // Reorder stage, empty optionals stand for items that threw.
+  std::map<std::uint64_t, std::optional<R>> map_pending_results_;
+  std::queue<boost::exception_ptr> queue_worker_exception_ptr_;
+  // Results ready to be emitted, in emit order. Only the worker that set
+  // flag_emitting_ calls EmitResult(), with mutex_workers_ unlocked.
+  std::deque<std::pair<std::uint64_t, R>> queue_ready_results_;
+  bool flag_emitting_ = false;
+
+  void RunItem(T& data, std::uint64_t sequence, ItemCompletion* completion);
+  void CompleteItem(std::optional<R>&& result, std::uint64_t sequence);
+  // Waits until at most max_in_flight items are being processed.
+  void WaitForWorkers(std::size_t max_in_flight) {
+    std::unique_lock<std::mutex> lock(mutex_workers_);
+    cond_var_workers_.wait(
+        lock, [this, max_in_flight] { return in_flight_ <= max_in_flight; });
+  }
+};
+
+template <typename T, typename R>
+void ParallelAsyncConsumer<T, R>::ProcessData() {
+  WaitForWorkers(kNumberOfWorkers_ - 1);
+  std::uint64_t sequence = next_sequence_++;
+  {
+    std::lock_guard<std::mutex> lock(mutex_workers_);
+    ++in_flight_;
+  }
+  // The worker completes the item, not the consumer thread.
+  ItemCompletion* completion = this->TakeLoadedCompletion();
+  pool_.Submit([this, sequence, completion,
+                data = std::move(this->loaded_data_)]() mutable {
+    RunItem(data, sequence, completion);
+  });
+  // Surface worker exceptions on the consumer thread, after the current
+  // item is dispatched so it is not lost.
+  RethrowWorkerException();
+}
+
+template <typename T, typename R>
+void ParallelAsyncConsumer<T, R>::RunItem(T& data, std::uint64_t sequence,
+                                          ItemCompletion* completion) {
+  std::optional<R> result;
+  boost::exception_ptr e_ptr;
+  try {
+    result.emplace(ProcessItem(data));
+  } catch (...) {
+    e_ptr = boost::current_exception();
+    std::lock_guard<std::mutex> lock(mutex_workers_);
+    queue_worker_exception_ptr_.push(e_ptr);
+  }
+  CompleteItem(std::move(result), sequence);
+  // Does not touch this, which may be gone once CompleteItem() returns.
+  if (completion) {
+    completion->Complete(e_ptr);
+  }
+}
+
+template <typename T, typename R>
+void ParallelAsyncConsumer<T, R>::CompleteItem(std::optional<R>&& result,
+                                               std::uint64_t sequence) {
+  std::unique_lock<std::mutex> lock(mutex_workers_);
+  if (!kFlagOrdered_) {
+    if (result) {
+      queue_ready_results_.emplace_back(sequence, std::move(*result));
+    }
+  } else {
+    map_pending_results_.emplace(sequence, std::move(result));
+    auto it = map_pending_results_.begin();
+    while (it != map_pending_results_.end() &&
+           it->first == next_emit_sequence_) {
+      if (it->second) {
+        queue_ready_results_.emplace_back(it->first, std::move(*it->second));
+      }
+      ++next_emit_sequence_;
+      it = map_pending_results_.erase(it);
+    }
+  }
+  // One worker at a time drains the ready results, which keeps them in
+  // order. The others leave theirs behind and return.
+  if (!flag_emitting_) {
+    flag_emitting_ = true;
+    while (!queue_ready_results_.empty()) {
+      std::deque<std::pair<std::uint64_t, R>> ready;
+      ready.swap(queue_ready_results_);
+      lock.unlock();
+      boost::exception_ptr e_ptr;
+      for (auto& item : ready) {
+        try {
+          EmitResult(std::move(item.second), item.first);
+        } catch (...) {
+          if (!e_ptr) {
+            e_ptr = boost::current_exception();
+          }
+        }
+      }
+      lock.lock();
+      if (e_ptr) {
+        queue_worker_exception_ptr_.push(e_ptr);
+      }
+    }
+    flag_emitting_ = false;
+  }
+  // Our own item keeps the consumer alive while we emit, see PostCoreLoop().
+  --in_flight_;
+  // Notify under the lock, the consumer may be destroyed once it returns.
+  cond_var_workers_.notify_all();
+}
+
+template <typename T, typename R>
+bool ParallelAsyncConsumer<T, R>::RethrowWorkerException() {
+  boost::exception_ptr e_ptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_workers_);
+    if (queue_worker_exception_ptr_.empty()) {
+      return false;
+    }
+    e_ptr = queue_worker_exception_ptr_.front();
+    queue_worker_exception_ptr_.pop();
+  }
+  boost::rethrow_exception(e_ptr);
+  return true;
+}
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_PARALLEL_ASYNC_CONSUMER_H_
@@ -0,0 +1,452 @@
+/*
+ * ring_async_consumer.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * RingAsyncConsumer is a typed AsyncConsumer backed by a bounded lock-free
+ *   RingBuffer. Producers publish with ProcessDataAsync() without taking a
+ *   mutex. The consumer thread only parks on lock_data_transfer_ when the
+ *   ring is really empty, and producers only touch the lock to wake it up.
+ *   Subclasses implement ProcessData() on loaded_data_, the same way as
+ *   subclasses of AsyncConsumer do.
+ *   When the ring is full, overflow_policy_ decides what the producer does.
+ *   The ring capacity bounds the buffer unless set_buffer_capacity() sets a
+ *   smaller one.
+ *   Pass an ItemCompletion to ProcessDataAsync() to be told, or to co_await,
+ *   when the item has been processed.
+ */
+
+#ifndef CPPTOOLKIT_RING_ASYNC_CONSUMER_H_
+#define CPPTOOLKIT_RING_ASYNC_CONSUMER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "async_consumer.h"
+#include "item_completion.h"
+#include "ring_buffer.h"
+
+namespace cpptoolkit {
+
+template <typename T>
+class RingAsyncConsumer : public AsyncConsumer {
+ public:
+  explicit RingAsyncConsumer(std::size_t capacity = 1024) : ring_(capacity) {}
+  virtual ~RingAsyncConsumer() { Close(); };
+  RingAsyncConsumer(const RingAsyncConsumer&) = delete;
+  RingAsyncConsumer& operator=(const RingAsyncConsumer&) = delete;
+
+  // Can be called from any number of producer threads.
+  void ProcessDataAsync(T data) { SubmitData(std::move(data), nullptr); }
+  // completion is completed once the item is processed or dropped, it must
+  // stay alive until then.
+  void ProcessDataAsync(T data, ItemCompletion& completion) {
+    SubmitData(std::move(data), &completion);
+  }
+
+  std::size_t buffer_size() const { return ring_.size(); }
+  std::size_t buffer_capacity() const { return ring_.capacity(); }
+
+ protected:
+  T loaded_data_{};
+  bool flag_data_loaded_ = false;
+  std::vector<T> loaded_batch_;
+  // Completions of loaded_data_ and loaded_batch_, may be nullptr.
+  ItemCompletion* loaded_completion_ = nullptr;
+  std::vector<ItemCompletion*> loaded_batch_completions_;
+
+  virtual void CoreLoop();
+  void RingCoreLoop();
+  void RingBatchCoreLoop();
+  // Same as CleanUpBuffer(), but completes the items' completions.
+  virtual void PostCoreLoop();
+
+  virtual void LoadDataForProcess() {
+    flag_data_loaded_ = PopData(loaded_data_, loaded_completion_);
+  }
+  virtual void ClearDataBuffer() {
+    while (DropOldestData()) {
+    }
+  }
+  virtual bool is_data_loaded() { return flag_data_loaded_; }
+  virtual bool is_need_wait_for_data() { return ring_.empty(); }
+  virtual bool is_data_buffer_empty() { return ring_.empty(); }
+
+  virtual std::size_t data_buffer_size() { return ring_.size(); }
+  virtual void LoadBatchForProcess(std::size_t max_batch_size) {
+    loaded_batch_.clear();
+    loaded_batch_completions_.clear();
+    T data{};
+    ItemCompletion* completion = nullptr;
+    while (loaded_batch_.size() < max_batch_size && PopData(data, completion)) {
+      loaded_batch_.push_back(std::move(data));
+      loaded_batch_completions_.push_back(completion);
+    }
+  }
+  // Override to handle the whole loaded_batch_ at once. The completions
+  // left in loaded_batch_completions_ are completed when it returns, with
+  // its exception if it throws.
+  // The default processes the items one by one and completes each with its
+  // own result. A warning only fails its own item, an error or worse stops
+  // the batch and the items not processed yet are completed as dropped.
+  virtual void ProcessBatch() {
+    for (std::size_t i = 0; i < loaded_batch_.size(); i++) {
+      loaded_data_ = std::move(loaded_batch_[i]);
+      loaded_completion_ = loaded_batch_completions_[i];
+      loaded_batch_completions_[i] = nullptr;
+      try {
+        ProcessLoadedData();
+      } catch (...) {
+        boost::exception_ptr e_ptr = boost::current_exception();
+        if (get_error_level(e_ptr) != ErrorLevel::E_WARNING) {
+          DropLoadedBatch(i + 1);
+          boost::rethrow_exception(e_ptr);
+        }
+        HandleException(e_ptr);
+      }
+    }
+    loaded_batch_.clear();
+  }
+
+  virtual bool DropOldestData() {
+    Envelope discard;
+    if (!ring_.try_pop(discard)) {
+      return false;
+    }
+    if (discard.completion) {
+      discard.completion->Complete(MakeDroppedException());
+    }
+    return true;
+  }
+
+  // Calls ProcessData() and completes loaded_completion_, unless
+  // ProcessData() took it over with TakeLoadedCompletion().
+  void ProcessLoadedData() {
+    try {
+      ProcessData();
+    } catch (...) {
+      CompleteLoadedData(boost::current_exception());
+      throw;
+    }
+    CompleteLoadedData(boost::exception_ptr());
+  }
+  // For ProcessData() implementations that finish the item later.
+  ItemCompletion* TakeLoadedCompletion() {
+    ItemCompletion* completion = loaded_completion_;
+    loaded_completion_ = nullptr;
+    return completion;
+  }
+
+  // Producer side: publish the data to the ring and wake the consumer if it
+  // is parked. Applies overflow_policy_ when the ring is full and returns
+  // false if the data was dropped.
+  bool PushData(T&& data, ItemCompletion* completion = nullptr);
+
+ private:
+  // Ring item, the data plus its enqueue time for the metrics and the
+  // caller's completion.
+  struct Envelope {
+    Envelope() = default;
+    Envelope(T&& data_in, std::int64_t enqueue_time_in,
+             ItemCompletion* completion_in)
+        : data(std::move(data_in)),
+          enqueue_time(enqueue_time_in),
+          completion(completion_in) {}
+    T data{};
+    std::int64_t enqueue_time = 0;
+    ItemCompletion* completion = nullptr;
+  };
+
+  RingBuffer<Envelope> ring_;
+  std::atomic<bool> flag_consumer_parked_{false};
+  std::atomic<int> waiting_producers_{0};
+
+  // Parks until the ring holds at least min_size items or the loop is
+  // stopped. Returns false if deadline is reached first.
+  bool ParkUntilData(std::size_t min_size = 1,
+                     std::chrono::steady_clock::time_point deadline =
+                         std::chrono::steady_clock::time_point::max());
+  void WakeConsumer();
+  void SubmitData(T&& data, ItemCompletion* completion);
+  bool PopData(T& data, ItemCompletion*& completion) {
+    Envelope envelope;
+    if (!ring_.try_pop(envelope)) {
+      return false;
+    }
+    if (envelope.enqueue_time != 0) {
+      metrics_.RecordQueueLatency(envelope.enqueue_time);
+    }
+    data = std::move(envelope.data);
+    completion = envelope.completion;
+    return true;
+  }
+  // Completes the items of loaded_batch_ from first on as dropped.
+  void DropLoadedBatch(std::size_t first) {
+    for (std::size_t i = first; i < loaded_batch_completions_.size(); i++) {
+      if (loaded_batch_completions_[i]) {
+        loaded_batch_completions_[i]->Complete(MakeDroppedException());
+        loaded_batch_completions_[i] = nullptr;
+      }
+    }
+    loaded_batch_.clear();
+  }
+  // Runs ProcessBatch() on loaded_batch_ and completes what it left over.
+  void ProcessLoadedBatch() {
+    boost::exception_ptr e_ptr;
+    try {
+      ProcessBatch();
+    } catch (...) {
+      e_ptr = boost::current_exception();
+    }
+    for (ItemCompletion* completion : loaded_batch_completions_) {
+      if (completion) {
+        completion->Complete(e_ptr);
+      }
+    }
+    loaded_batch_completions_.clear();
+    if (e_ptr) {
+      boost::rethrow_exception(e_ptr);
+    }
+  }
+  void CompleteLoadedData(boost::exception_ptr e_ptr) {
+    ItemCompletion* completion = TakeLoadedCompletion();
+    if (completion) {
+      completion->Complete(e_ptr);
+    }
+  }
+  static boost::exception_ptr MakeDroppedException() {
+    return boost::copy_exception(
+        boost::enable_error_info(std::runtime_error("Data dropped.")) <<
+        error_level(ErrorLevel::E_WARNING));
+  }
+  bool is_ring_full() const {
+    std::size_t capacity = ring_.capacity();
+    if (buffer_capacity_ > 0 && buffer_capacity_ < capacity) {
+      capacity = buffer_capacity_;
+    }
+    return ring_.size() >= capacity;
+  }
+  // Blocks a producer until there is room in the ring. Returns false if
+  // block_timeout_ is reached first.
+  bool WaitForSpace();
+  // Consumer side, wakes producers blocked in WaitForSpace().
+  void NotifyProducers();
+};
+
+template <typename T>
+bool RingAsyncConsumer<T>::PushData(T&& data, ItemCompletion* completion) {
+  for (;;) {
+    // emplace() only moves data once it has a free cell.
+    if (!is_ring_full() &&
+        ring_.emplace(std::move(data), MetricsNow(), completion)) {
+      WakeConsumer();
+      return true;
+    }
+    switch (overflow_policy_) {
+      case OverflowPolicy::kBlock:
+        ++blocked_count_;
+        if (!WaitForSpace()) {
+          ++dropped_count_;
+          CPPTOOLKIT_THROW_EXCEPTION(
+              std::runtime_error("Ring buffer stayed full for " +
+                                 std::to_string(block_timeout_.count()) +
+                                 " ms, data dropped."),
+              ErrorLevel::E_WARNING);
+        }
+        break;
+      case OverflowPolicy::kDropOldest:
+        ++dropped_count_;
+        DropOldestData();
+        break;
+      case OverflowPolicy::kDropNewest:
+        ++dropped_count_;
+        return false;
+      case OverflowPolicy::kWarn:
+      default:
+        ++dropped_count_;
+        CPPTOOLKIT_THROW_EXCEPTION(
+            std::runtime_error("Ring buffer is full, data dropped."),
+            ErrorLevel::E_WARNING);
+    }
+  }
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::SubmitData(T&& data, ItemCompletion* completion) {
+  PreGetData();
+  try {
+    if (flag_handling_error_ || !PushData(std::move(data), completion)) {
+      if (completion) {
+        completion->Complete(MakeDroppedException());
+      }
+    }
+  } catch (...) {
+    if (completion) {
+      completion->Complete(boost::current_exception());
+    }
+    auto level = HandleException(boost::current_exception());
+    if (level == ErrorLevel::E_CRITICAL) {
+      boost::rethrow_exception(boost::current_exception());
+    }
+  }
+  PostGetData();
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::CoreLoop() {
+  if (is_batch_mode()) {
+    RingBatchCoreLoop();
+  } else {
+    RingCoreLoop();
+  }
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::RingCoreLoop() {
+  try {
+    if (ring_.empty()) {
+      ParkUntilData();
+    }
+    if (!flag_run_) {
+      return;
+    }
+    LoadDataForProcess();
+    NotifyProducers();
+    if (flag_data_loaded_) {
+      std::int64_t process_start = MetricsNow();
+      ProcessLoadedData();
+      if (process_start) {
+        metrics_.RecordQueueDepth(ring_.size());
+        metrics_.RecordProcessTime(ConsumerMetrics::Now() - process_start, 1);
+      }
+    }
+  } catch (...) {
+    HandleException(boost::current_exception());
+  }
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::RingBatchCoreLoop() {
+  try {
+    if (ring_.empty()) {
+      ParkUntilData();
+    }
+    if (!flag_run_) {
+      return;
+    }
+    if (batch_max_latency_.count() > 0) {
+      auto deadline = std::chrono::steady_clock::now() + batch_max_latency_;
+      while (flag_run_ && ring_.size() < batch_max_size_ &&
+             ParkUntilData(batch_max_size_, deadline)) {
+      }
+    }
+    LoadBatchForProcess(batch_max_size_);
+    NotifyProducers();
+    if (!loaded_batch_.empty()) {
+      std::size_t number_of_items = loaded_batch_.size();
+      std::int64_t process_start = MetricsNow();
+      ProcessLoadedBatch();
+      if (process_start) {
+        metrics_.RecordQueueDepth(ring_.size());
+        metrics_.RecordProcessTime(ConsumerMetrics::Now() - process_start,
+                                   number_of_items);
+      }
+    }
+  } catch (...) {
+    HandleException(boost::current_exception());
+  }
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::PostCoreLoop() {
+  while (!is_data_buffer_empty()) {
+    try {
+      // Drain through the same hook as the loop, ProcessBatch() may be the
+      // only one a batch mode subclass implements.
+      if (is_batch_mode()) {
+        LoadBatchForProcess(batch_max_size_);
+        NotifyProducers();
+        if (!loaded_batch_.empty()) {
+          ProcessLoadedBatch();
+        }
+      } else {
+        LoadDataForProcess();
+        NotifyProducers();
+        if (flag_data_loaded_) {
+          ProcessLoadedData();
+        }
+      }
+    } catch (...) {
+      auto level = HandleException(boost::current_exception());
+      if (level != ErrorLevel::E_WARNING) {
+        ClearDataBuffer();
+      }
+    }
+  }
+}
+
+template <typename T>
+bool RingAsyncConsumer<T>::ParkUntilData(
+    std::size_t min_size, std::chrono::steady_clock::time_point deadline) {
+  bool flag_signaled = true;
+  SafeLockUp lock(lock_data_transfer_, 0);
+  flag_consumer_parked_.store(true, std::memory_order_seq_cst);
+  // Pairs with the fence in WakeConsumer(): either the producer sees the
+  // parked flag, or we see its data here.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring_.size() < min_size && flag_run_) {
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+      lock.wait();
+    } else {
+      flag_signaled = lock.wait_until(deadline);
+    }
+  } else {
+    lock.signal_off();  // reset signal flag.
+  }
+  flag_consumer_parked_.store(false, std::memory_order_relaxed);
+  return flag_signaled;
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::WakeConsumer() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (flag_consumer_parked_.load(std::memory_order_relaxed)) {
+    SafeLockUp lock(lock_data_transfer_, 0);
+    lock.notify_and_unlock();
+  }
+}
+
+template <typename T>
+bool RingAsyncConsumer<T>::WaitForSpace() {
+  auto deadline = std::chrono::steady_clock::now() + block_timeout_;
+  SafeLockUp lock(lock_data_transfer_, 0);
+  waiting_producers_.fetch_add(1, std::memory_order_seq_cst);
+  // Pairs with the fence in NotifyProducers().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  // Never block on a stopped consumer, nobody would make room.
+  bool flag_space = lock.wait_until(1, deadline, [this] {
+    return !flag_run_ || !is_ring_full();
+  });
+  waiting_producers_.fetch_sub(1, std::memory_order_relaxed);
+  return flag_space;
+}
+
+template <typename T>
+void RingAsyncConsumer<T>::NotifyProducers() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting_producers_.load(std::memory_order_relaxed) > 0) {
+    SafeLockUp lock(lock_data_transfer_, 0);
+    lock_data_transfer_.notify_all(1);
+    lock.signal_off();  // we are the consumer, no data signal to send.
+  }
+}
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_RING_ASYNC_CONSUMER_H_
@@ -0,0 +1,156 @@
+/*
+ * ring_buffer.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * RingBuffer is a bounded lock-free queue for passing data between threads.
+ *   Every cell carries a sequence number (Vyukov's bounded queue), so any
+ *   number of producers and consumers can push and pop without a mutex.
+ *   The capacity is rounded up to a power of two and never changes.
+ */
+
+#ifndef CPPTOOLKIT_RING_BUFFER_H_
+#define CPPTOOLKIT_RING_BUFFER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "cache_line.h"
+
+namespace cpptoolkit {
+
+template <typename T>
+class RingBuffer {
+ public:
+  explicit RingBuffer(std::size_t capacity)
+      : kCapacity_(RoundUpToPowerOfTwo(capacity)),
+        kMask_(kCapacity_ - 1),
+        cells_(new Cell[kCapacity_]) {
+    if (capacity == 0) {
+      throw std::invalid_argument("RingBuffer capacity must be positive.");
+    }
+    for (std::size_t i = 0; i < kCapacity_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  ~RingBuffer() {
+    // No other thread may touch the buffer any more, destroy what is left.
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    for (; head != tail; ++head) {
+      std::launder(reinterpret_cast<T*>(cells_[head & kMask_].storage))->~T();
+    }
+  }
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  // Returns false without touching value if the buffer is full.
+  bool try_push(T&& value) { return emplace(std::move(value)); }
+  bool try_push(const T& value) { return emplace(value); }
+
+  template <typename... Args>
+  bool emplace(Args&&... args) {
+    Cell* cell;
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & kMask_];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      std::intptr_t diff =
+          static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // full
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+    new (cell->storage) T(std::forward<Args>(args)...);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the buffer is empty.
+  bool try_pop(T& value) {
+    Cell* cell;
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & kMask_];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      std::intptr_t diff = static_cast<std::intptr_t>(seq) -
+                           static_cast<std::intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;  // empty
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    T* item = std::launder(reinterpret_cast<T*>(cell->storage));
+    value = std::move(*item);
+    item->~T();
+    cell->sequence.store(pos + kMask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // The following queries are snapshots and may be stale by the time the
+  // caller looks at them when other threads are pushing or popping.
+  // A producer claims its cell (moves tail_) before it publishes the item,
+  // so emptiness comes from the sequence number of the cell at head_: the
+  // ring is empty exactly when try_pop() would find nothing there.
+  bool empty() const {
+    std::size_t head = head_.load(std::memory_order_acquire);
+    std::size_t seq =
+        cells_[head & kMask_].sequence.load(std::memory_order_acquire);
+    return static_cast<std::intptr_t>(seq) -
+               static_cast<std::intptr_t>(head + 1) < 0;
+  }
+  // Claimed cells, including ones still being published. 0 when empty().
+  std::size_t size() const {
+    if (empty()) {
+      return 0;
+    }
+    std::size_t head = head_.load(std::memory_order_acquire);
+    std::size_t tail = tail_.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 1;
+  }
+  std::size_t capacity() const { return kCapacity_; }
+
+ private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+
+  static std::size_t RoundUpToPowerOfTwo(std::size_t n) {
+    std::size_t result = 1;
+    while (result < n) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const std::size_t kCapacity_;
+  const std::size_t kMask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(kCacheLineSize) std::atomic<std::size_t> tail_{0};  // producers
+  alignas(kCacheLineSize) std::atomic<std::size_t> head_{0};  // consumers
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_RING_BUFFER_H_
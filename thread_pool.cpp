@@ -0,0 +1,126 @@
+#include "thread_pool.h"
+#include <boost/exception/all.hpp>
+#include "log.h"
+
+namespace cpptoolkit {
+
+namespace {
+// Identifies the pool and queue of the current worker thread.
+thread_local ThreadPool* tls_pool = nullptr;
+thread_local std::size_t tls_queue_index = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(std::size_t number_of_threads) {
+  if (number_of_threads == 0) {
+    number_of_threads = std::thread::hardware_concurrency();
+    if (number_of_threads == 0) {
+      number_of_threads = 1;
+    }
+  }
+  for (std::size_t i = 0; i < number_of_threads; i++) {
+    queues_.push_back(std::make_unique<WorkerQueue>());
+  }
+  for (std::size_t i = 0; i < number_of_threads; i++) {
+    threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_sleep_);
+    flag_stop_ = true;
+  }
+  cond_var_sleep_.notify_all();
+  for (auto& thread : threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+}
+
+ThreadPool& ThreadPool::GlobalInstance() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::Submit(Task task) {
+  std::size_t index;
+  if (tls_pool == this) {
+    index = tls_queue_index;
+  } else {
+    index = next_queue_.fetch_add(1, std::memory_order_relaxed) %
+            queues_.size();
+  }
+  // Count the task before it is visible, so a worker never decrements
+  // below zero.
+  pending_tasks_.fetch_add(1, std::memory_order_seq_cst);
+  {
+    std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+    queues_[index]->tasks.push_back(std::move(task));
+  }
+  // Pairs with the fence in WorkerLoop(): either we see the sleeper, or it
+  // sees the pending task and does not sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) > 0) {
+    // Lock once, so a worker between its check and its wait is not missed.
+    { std::lock_guard<std::mutex> lock(mutex_sleep_); }
+    cond_var_sleep_.notify_one();
+  }
+}
+
+bool ThreadPool::TryPopLocal(std::size_t index, Task& task) {
+  WorkerQueue& queue = *queues_[index];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) {
+    return false;
+  }
+  task = std::move(queue.tasks.back());
+  queue.tasks.pop_back();
+  return true;
+}
+
+bool ThreadPool::TrySteal(std::size_t index, Task& task) {
+  for (std::size_t i = 1; i < queues_.size(); i++) {
+    WorkerQueue& queue = *queues_[(index + i) % queues_.size()];
+    std::unique_lock<std::mutex> lock(queue.mutex, std::try_to_lock);
+    if (!lock.owns_lock() || queue.tasks.empty()) {
+      continue;
+    }
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::WorkerLoop(std::size_t index) {
+  tls_pool = this;
+  tls_queue_index = index;
+  for (;;) {
+    Task task;
+    if (TryPopLocal(index, task) || TrySteal(index, task)) {
+      --pending_tasks_;
+      try {
+        task();
+      } catch (...) {
+        // Tasks are expected to handle their own exceptions.
+        LOG_ERROR("[ThreadPool]Uncaught exception in task: {}",
+                  boost::current_exception_diagnostic_information());
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_sleep_);
+    if (flag_stop_ && pending_tasks_ == 0) {
+      return;
+    }
+    sleepers_.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    // A steal may have missed a task behind a busy try_lock, so only sleep
+    // when nothing is pending at all.
+    cond_var_sleep_.wait(lock,
+                         [this] { return flag_stop_ || pending_tasks_ > 0; });
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace cpptoolkit
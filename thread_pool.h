@@ -0,0 +1,106 @@
+/*
+ * thread_pool.h
+ *
+ * Created on 20261018
+ *   by Yukun Cheng
+ *   cyk_phy@mail.ustc.edu.cn
+ *
+ * ThreadPool is a work-stealing pool of worker threads.
+ *   Every worker owns a task deque. Tasks submitted from a worker go to its
+ *   own deque and are taken LIFO, tasks submitted from other threads are
+ *   spread round-robin. An idle worker steals FIFO from the other deques
+ *   before it goes to sleep.
+ *   GlobalInstance() is a pool sized to the hardware that every consumer
+ *   in the process can share.
+ */
+
+#ifndef CPPTOOLKIT_THREAD_POOL_H_
+#define CPPTOOLKIT_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "cache_line.h"
+
+namespace cpptoolkit {
+
+class ThreadPool {
+ public:
+  // A move-only callable, so tasks can own move-only data such as
+  // std::unique_ptr buffers.
+  class Task {
+   public:
+    Task() = default;
+    template <typename F,
+              typename = std::enable_if_t<
+                  !std::is_same<std::decay_t<F>, Task>::value>>
+    Task(F&& func)
+        : impl_(std::make_unique<Impl<std::decay_t<F>>>(
+              std::forward<F>(func))) {}
+    Task(Task&&) = default;
+    Task& operator=(Task&&) = default;
+
+    void operator()() { impl_->Run(); }
+    explicit operator bool() const { return static_cast<bool>(impl_); }
+
+   private:
+    struct Base {
+      virtual ~Base() = default;
+      virtual void Run() = 0;
+    };
+    template <typename F>
+    struct Impl : Base {
+      explicit Impl(F&& func) : func_(std::move(func)) {}
+      explicit Impl(const F& func) : func_(func) {}
+      void Run() override { func_(); }
+      F func_;
+    };
+    std::unique_ptr<Base> impl_;
+  };
+
+  // number_of_threads == 0 uses std::thread::hardware_concurrency().
+  explicit ThreadPool(std::size_t number_of_threads = 0);
+  // Runs the tasks still queued, then joins the workers.
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void Submit(Task task);
+
+  std::size_t size() const { return threads_.size(); }
+  std::size_t pending_tasks() const { return pending_tasks_.load(); }
+
+  // Process-wide pool sized to the hardware, created on first use.
+  static ThreadPool& GlobalInstance();
+
+ private:
+  struct alignas(kCacheLineSize) WorkerQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> flag_stop_{false};
+  std::atomic<std::size_t> next_queue_{0};
+  std::atomic<std::size_t> pending_tasks_{0};
+  // Workers parked on cond_var_sleep_, Submit() only notifies if any.
+  std::atomic<std::size_t> sleepers_{0};
+  std::mutex mutex_sleep_;
+  std::condition_variable cond_var_sleep_;
+
+  void WorkerLoop(std::size_t index);
+  bool TryPopLocal(std::size_t index, Task& task);
+  bool TrySteal(std::size_t index, Task& task);
+};
+
+}  // namespace cpptoolkit
+
+#endif  // CPPTOOLKIT_THREAD_POOL_H_